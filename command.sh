@@ -1 +1 @@
-g++ consolecity3.cpp ../console/advancedConsole.cpp ../console/console.linux.cpp -I../console -o consolecity3.o -lncursesw -lpthread
+g++ -O3 consolecity3.cpp ../console/advancedConsole.cpp ../console/console.linux.cpp -I../console -o consolecity3.o -lncursesw -lpthread
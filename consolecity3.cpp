@@ -1,14 +1,89 @@
 #include <math.h>
+#include <limits.h>
+#include <float.h>
 #include <chrono>
 #include <vector>
 #include <set>
+#include <list>
+#include <queue>
+#include <unordered_map>
 #include <iterator>
+#include <thread>
+#include <mutex>
+#include <shared_mutex>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <stdint.h>
 #include "graphics.h"
 #include "sprites.h"
 
 #pragma region //Forward declarations, defines, and typedefs
 
+#ifdef FIXED_NET
+/*
+48.16 fixed point quantity for networks
+Integer adds make totals independent of summation order
+*/
+struct fixed_net {
+	static const int FRACTION_BITS = 16;
+	static const long long ONE = 1ll << FRACTION_BITS;
+
+	fixed_net() : raw(0) {}
+	fixed_net(int v) : raw((long long)v * ONE) {}
+	fixed_net(float v) : raw(llroundf(v * ONE)) {}
+	fixed_net(double v) : raw(llround(v * ONE)) {}
+
+	static fixed_net fromRaw(long long r) {
+		fixed_net f;
+		f.raw = r;
+		return f;
+	}
+
+	float toFloat() const {
+		return float(raw) / ONE;
+	}
+
+	fixed_net operator-() const { return fromRaw(-raw); }
+	fixed_net operator+(fixed_net b) const { return fromRaw(raw + b.raw); }
+	fixed_net operator-(fixed_net b) const { return fromRaw(raw - b.raw); }
+	fixed_net operator*(fixed_net b) const {
+		return fromRaw((long long)(((__int128)raw * b.raw) >> FRACTION_BITS));
+	}
+	fixed_net operator/(fixed_net b) const {
+		if (b.raw == 0)
+			return fromRaw(0);
+		return fromRaw((long long)(((__int128)raw << FRACTION_BITS) / b.raw));
+	}
+	fixed_net &operator+=(fixed_net b) { raw += b.raw; return *this; }
+	fixed_net &operator-=(fixed_net b) { raw -= b.raw; return *this; }
+
+	bool operator==(fixed_net b) const { return raw == b.raw; }
+	bool operator!=(fixed_net b) const { return raw != b.raw; }
+	bool operator<(fixed_net b) const { return raw < b.raw; }
+	bool operator>(fixed_net b) const { return raw > b.raw; }
+	bool operator<=(fixed_net b) const { return raw <= b.raw; }
+	bool operator>=(fixed_net b) const { return raw >= b.raw; }
+
+	long long raw;
+};
+
+typedef fixed_net net_t;
+typedef long long net_scalar;
+
+float netf(fixed_net v) {
+	return v.toFloat();
+}
+#else
 typedef float net_t;
+typedef float net_scalar;
+
+float netf(float v) {
+	return v;
+}
+#endif
+
+static_assert(sizeof(net_t) == sizeof(net_scalar), "net_t must wrap a single scalar");
 
 struct default_tile;
 struct _game;
@@ -25,6 +100,8 @@ tilePartial *getPartial(posi p);
 tileComplete getComplete(int x, int y);
 tileComplete getComplete(posi p);
 tileEvent getEvent(sizei p);
+void markLot(int x, int y);
+void markRowsEdited(sizei area);
 
 #define ZONING_NONE 0
 #define ZONING_RESIDENTIAL 1
@@ -40,6 +117,40 @@ tileEvent getEvent(sizei p);
 #define SOUTH_F x,y+1
 #define UNDERGROUND_WATER_PIPE 1
 #define UNDERGROUND_SUBWAY 2
+#define DEMAND_CHUNK 16
+#define FIELD_ENVIRONMENT 0
+#define FIELD_HEALTH 1
+#define FIELD_SAFETY 2
+#define FIELD_TRAFFIC 3
+#define FIELD_EDUCATION 4
+#define FIELD_LANDVALUE 5
+#define FIELD_COUNT 6
+#define FIELD_BAND_ROWS 64
+
+#define STATS_ROWS 64 //Rows per partial of a reduction
+#define STATS_BINS 8
+#define LOD_CHUNK 16
+#define LOD_FIELD_CADENCE 4
+#define TRAFFIC_ROAD 1
+#define ROAD_LANDMARKS 4
+#define ROUTE_CACHE_SIZE 256
+#define COMMUTE_NONE 0xffff
+#define COMMUTE_MAX 48
+#define SERVICE_CLINIC 0
+#define SERVICE_SCHOOL 1
+#define SERVICE_POLICE 2
+#define SERVICE_COUNT 3
+#define SERVICE_EMIT 0.02f
+
+#define DIRTY_PAD_TILES 3 //Tiles a sprite can reach past its own, tall and wide plops and connections
+#define TERRAIN_CHUNK 16
+#define TERRAIN_BUDGET (32 << 20) //Bytes of pre-rendered ground kept
+
+#define ROAD_REACH 1 //Same as commutes, a road on or next to the plop
+
+#define DEVELOP_BUDGET 4 //Lots looked at per tick
+#define DEVELOP_FILL 0.75f //Occupancy at which a zone builds more
+#define DEVELOP_ABANDON 0.25f //Occupancy under which empty buildings are abandoned
 
 /*
 octet 0 : 00 - none
@@ -95,6 +206,9 @@ Fire station, police station
 tilePartial *tileMap = nullptr;
 int tileMapHeight = 100;
 int tileMapWidth = 100;
+std::vector<unsigned long> tileRowEdits; //Publish epoch of the last write per row
+unsigned long tileEpoch = 1;
+bool tilesTouched = false; //Any row written since the last publish
 
 FILE *logFile = stderr;
 
@@ -122,6 +236,541 @@ int microday;
 int day;
 int month;
 
+int networkBudget = 2000; //microseconds of network solve per frame
+
+/*
+Running capacity and population per zone, for the map and per chunk
+Updated when zoned plops are placed, destroyed or change occupancy
+*/
+struct demand_totals {
+	struct zone_total {
+		int capacity = 0;
+		int population = 0;
+	};
+
+	zone_total map[4];
+	std::vector<zone_total> chunks; //4 per chunk
+	int chunksX = 0, chunksY = 0;
+
+	void reset(int width, int height) {
+		chunksX = (width + DEMAND_CHUNK - 1) / DEMAND_CHUNK;
+		chunksY = (height + DEMAND_CHUNK - 1) / DEMAND_CHUNK;
+		chunks.assign(chunksX * chunksY * 4, zone_total());
+		for (zone_total &z : map)
+			z = zone_total();
+		publish();
+	}
+
+	zone_total &chunk(int zone, int x, int y) {
+		int cx = std::min(std::max(x / DEMAND_CHUNK, 0), chunksX - 1);
+		int cy = std::min(std::max(y / DEMAND_CHUNK, 0), chunksY - 1);
+		return chunks[(cy * chunksX + cx) * 4 + zone];
+	}
+
+	void add(int zone, int x, int y, int capacity, int population) {
+		if (zone == ZONING_NONE || chunks.empty())
+			return;
+		zone_total &c = chunk(zone, x, y);
+		c.capacity += capacity;
+		c.population += population;
+		map[zone].capacity += capacity;
+		map[zone].population += population;
+		publish();
+	}
+
+	void remove(int zone, int x, int y, int capacity, int population) {
+		add(zone, x, y, -capacity, -population);
+	}
+
+	void occupy(int zone, int x, int y, int change) {
+		add(zone, x, y, 0, change);
+	}
+
+	static float ratio(zone_total z) {
+		return float(z.population + 1) / float(z.capacity + 1);
+	}
+
+	float getDemand(int zone) {
+		return ratio(map[zone]);
+	}
+
+	//Demand of the chunk holding x,y
+	float getDemand(int zone, int x, int y) {
+		if (chunks.empty())
+			return getDemand(zone);
+		return ratio(chunk(zone, x, y));
+	}
+
+	//Keep the old globals current for the overlay
+	void publish() {
+		population = map[ZONING_RESIDENTIAL].population;
+		residentialCapacity = map[ZONING_RESIDENTIAL].capacity;
+		commercialPopulation = map[ZONING_COMMERCIAL].population;
+		commercialJobs = map[ZONING_COMMERCIAL].capacity;
+		industrialPopulation = map[ZONING_INDUSTRIAL].population;
+		industrialJobs = map[ZONING_INDUSTRIAL].capacity;
+		residentialDemand = getDemand(ZONING_RESIDENTIAL);
+		commercialDemand = getDemand(ZONING_COMMERCIAL);
+		industrialDemand = getDemand(ZONING_INDUSTRIAL);
+	}
+} demandTotals;
+
+int lodRadius = 32; //tiles past the edge of the view simulated every tick, 0 simulates everything
+
+/*
+Simulation level of detail per chunk
+
+Chunks around the view run every tick. The rest owe their random ticks and field days,
+which are settled in bulk when the chunk comes into view, on its field cadence, or at
+the start of a month
+*/
+struct sim_lod {
+	int chunksX = 0, chunksY = 0;
+	bool active = false;
+	std::vector<double> settledAt; //farEvents when the chunk last settled its random ticks
+	std::vector<int> fieldOwed; //Field days owed
+	std::vector<int> fieldDays; //Days each chunk steps today, 0 to skip
+	std::vector<unsigned char> rowSteps; //Any chunk in the row steps today
+	double farEvents = 0; //Random ticks owed per tile since reset
+	int x0 = 0, y0 = 0, x1 = 0, y1 = 0; //Chunk box around the view, exclusive end
+
+	//Written by the main thread
+	std::atomic<int> viewX{0}, viewY{0}, viewRadius{0};
+
+	void reset(int width, int height) {
+		chunksX = (width + LOD_CHUNK - 1) / LOD_CHUNK;
+		chunksY = (height + LOD_CHUNK - 1) / LOD_CHUNK;
+		settledAt.assign(chunksX * chunksY, 0.0);
+		fieldOwed.assign(chunksX * chunksY, 0);
+		fieldDays.assign(chunksX * chunksY, 1);
+		rowSteps.assign(chunksY, 1);
+		farEvents = 0;
+		x0 = y0 = 0;
+		x1 = chunksX;
+		y1 = chunksY;
+	}
+
+	void setView(posf center, float radius) {
+		viewX = center.x;
+		viewY = center.y;
+		viewRadius = radius;
+	}
+
+	//Refresh the chunk box from the view
+	void update(bool enabled) {
+		active = enabled && lodRadius > 0 && viewRadius > 0;
+		if (!active) {
+			x0 = y0 = 0;
+			x1 = chunksX;
+			y1 = chunksY;
+			return;
+		}
+		int r = viewRadius + lodRadius;
+		x0 = std::max((viewX - r) / LOD_CHUNK, 0);
+		y0 = std::max((viewY - r) / LOD_CHUNK, 0);
+		x1 = std::max(std::min((viewX + r) / LOD_CHUNK + 1, chunksX), 0);
+		y1 = std::max(std::min((viewY + r) / LOD_CHUNK + 1, chunksY), 0);
+		//View panned off the map, keep an empty box inside it
+		x0 = std::min(x0, x1);
+		y0 = std::min(y0, y1);
+	}
+
+	bool isNear(int c) {
+		int cx = c % chunksX, cy = c / chunksX;
+		return cx >= x0 && cx < x1 && cy >= y0 && cy < y1;
+	}
+
+	int chunkOf(int x, int y) {
+		return (y / LOD_CHUNK) * chunksX + x / LOD_CHUNK;
+	}
+
+	//Random ticks a chunk has missed
+	double owedEvents(int c) {
+		return (farEvents - settledAt[c]) * LOD_CHUNK * LOD_CHUNK;
+	}
+
+	//Pick the chunks that step their fields today, and for how many days
+	void fieldDay(bool all) {
+		std::fill(rowSteps.begin(), rowSteps.end(), 0);
+		for (size_t c = 0; c < fieldOwed.size(); c++) {
+			int owed = ++fieldOwed[c];
+			if (!active || all || owed >= LOD_FIELD_CADENCE || isNear(c)) {
+				fieldDays[c] = owed;
+				fieldOwed[c] = 0;
+				rowSteps[c / chunksX] = 1;
+			} else {
+				fieldDays[c] = 0;
+			}
+		}
+	}
+} lod;
+
+/*
+Fixed set of worker threads for data parallel loops, used from the simulation thread
+run() hands out job indices until all are taken, the calling thread takes jobs too
+*/
+struct worker_pool {
+	std::vector<std::thread> threads;
+	std::mutex mutex;
+	std::condition_variable wake, done;
+	void (*job)(void *, int) = nullptr; //Calls the loop body of the running job
+	void *body = nullptr;
+	int jobs = 0;
+	std::atomic<int> next{0};
+	int busy = 0;
+	unsigned long generation = 0;
+	bool stopping = false;
+	bool started = false;
+
+	~worker_pool() {
+		stop();
+	}
+
+	void start() {
+		started = true;
+		int count = (int)std::thread::hardware_concurrency() - 1;
+		for (int i = 0; i < count; i++)
+			threads.emplace_back(&worker_pool::work, this);
+	}
+
+	void stop() {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stopping = true;
+		}
+		wake.notify_all();
+		for (std::thread &t : threads)
+			t.join();
+		threads.clear();
+	}
+
+	void take() {
+		for (int i = next++; i < jobs; i = next++)
+			job(body, i);
+	}
+
+	void work() {
+		unsigned long seen = 0;
+		while (true) {
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				wake.wait(lock, [&] { return stopping || generation != seen; });
+				if (stopping)
+					return;
+				seen = generation;
+			}
+			take();
+			std::lock_guard<std::mutex> lock(mutex);
+			if (--busy == 0)
+				done.notify_one();
+		}
+	}
+
+	//The body stays on the caller's stack, nothing is copied or allocated per run
+	template<typename T>
+	void run(int count, T fn) {
+		if (!started)
+			start();
+		if (threads.empty() || count < 2) {
+			for (int i = 0; i < count; i++)
+				fn(i);
+			return;
+		}
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			job = [](void *b, int i) { (*(T *)b)(i); };
+			body = &fn;
+			jobs = count;
+			next = 0;
+			busy = threads.size();
+			generation++;
+		}
+		wake.notify_all();
+		take();
+		std::unique_lock<std::mutex> lock(mutex);
+		done.wait(lock, [&] { return busy == 0; });
+	}
+} workers;
+
+/*
+Count, sum, min, max and a histogram over 0 to 1 of a set of samples
+*/
+struct plane_stats {
+	int count = 0;
+	double sum = 0.0;
+	float min = FLT_MAX, max = -FLT_MAX;
+	int histogram[STATS_BINS] = {};
+
+	void add(float value) {
+		count++;
+		sum += value;
+		min = std::min(min, value);
+		max = std::max(max, value);
+		histogram[std::min(std::max(int(value * STATS_BINS), 0), STATS_BINS - 1)]++;
+	}
+
+	void merge(const plane_stats &b) {
+		count += b.count;
+		sum += b.sum;
+		min = std::min(min, b.min);
+		max = std::max(max, b.max);
+		for (int i = 0; i < STATS_BINS; i++)
+			histogram[i] += b.histogram[i];
+	}
+
+	float mean() {
+		return count ? sum / count : 0.0f;
+	}
+};
+
+/*
+Reduce sample(index) over a width by height plane, one partial per band of STATS_ROWS rows
+Only the bands refresh(band) picks are sampled again, the others keep their partial.
+Bands run on the worker pool and merge in band order, so the result does not depend
+on the number of threads
+*/
+template<typename T, typename R>
+plane_stats reduce(int width, int height, T sample, std::vector<plane_stats> &partial, R refresh) {
+	int count = (height + STATS_ROWS - 1) / STATS_ROWS;
+	partial.resize(count);
+	workers.run(count, [&](int b) {
+		if (!refresh(b))
+			return;
+		plane_stats &s = partial[b];
+		s = plane_stats();
+		//Each row is copied out, then summed in separate lanes so it vectorizes
+		static thread_local std::vector<float> values;
+		static thread_local std::vector<int> bin;
+		values.resize(width);
+		bin.resize(width);
+		float low[8], high[8];
+		int bins[4][STATS_BINS] = {}; //Four histograms so the counts do not wait on each other
+		for (int j = 0; j < 8; j++) {
+			low[j] = FLT_MAX;
+			high[j] = -FLT_MAX;
+		}
+		for (int y = b * STATS_ROWS; y < std::min((b + 1) * STATS_ROWS, height); y++) {
+			float *row = values.data();
+			for (int x = 0; x < width; x++)
+				row[x] = sample(y * width + x);
+
+			//Row sums in float, the band total in double
+			float sum[8] = {};
+			int x = 0;
+			for (; x + 8 <= width; x += 8) {
+				for (int j = 0; j < 8; j++) {
+					sum[j] += row[x + j];
+					low[j] = std::min(low[j], row[x + j]);
+					high[j] = std::max(high[j], row[x + j]);
+				}
+			}
+			for (; x < width; x++) {
+				sum[0] += row[x];
+				low[0] = std::min(low[0], row[x]);
+				high[0] = std::max(high[0], row[x]);
+			}
+			for (int j = 0; j < 8; j++)
+				s.sum += sum[j];
+			s.count += width;
+
+			for (x = 0; x < width; x++)
+				bin[x] = std::min(std::max(int(row[x] * STATS_BINS), 0), STATS_BINS - 1);
+			for (x = 0; x + 4 <= width; x += 4)
+				for (int j = 0; j < 4; j++)
+					bins[j][bin[x + j]]++;
+			for (; x < width; x++)
+				bins[0][bin[x]]++;
+		}
+		for (int j = 0; j < 8; j++) {
+			s.min = std::min(s.min, low[j]);
+			s.max = std::max(s.max, high[j]);
+		}
+		for (int i = 0; i < STATS_BINS; i++)
+			s.histogram[i] = bins[0][i] + bins[1][i] + bins[2][i] + bins[3][i];
+	});
+	plane_stats total;
+	for (plane_stats &s : partial)
+		total.merge(s);
+	return total;
+}
+
+/*
+Per tile scalar fields, one float plane each
+A step injects sources, decays toward the base value and blurs with a separable 1 2 1 kernel
+Large maps are split into row bands on the worker pool
+*/
+struct field_engine {
+	int width = 0, height = 0;
+	float base = 0.5f;
+	float keep = 0.9f; //Fraction of the offset from base kept each step
+	std::vector<float> planes[FIELD_COUNT];
+	std::vector<float> sources[FIELD_COUNT];
+	std::vector<float> scratch[FIELD_COUNT];
+
+	void reset(int width, int height) {
+		this->width = width;
+		this->height = height;
+		for (int f = 0; f < FIELD_COUNT; f++) {
+			planes[f].assign(width * height, base);
+			sources[f].assign(width * height, 0.0f);
+			scratch[f].assign(width * height, 0.0f);
+			bandStats[f].clear();
+		}
+		publish();
+	}
+
+	float get(int field, int x, int y) {
+		return planes[field][y * width + x];
+	}
+
+	//Add emissions over an area, sign -1 takes them away again
+	void addSource(sizei area, const float *emit, float sign) {
+		for (int f = 0; f < FIELD_COUNT; f++) {
+			if (emit[f] == 0.0f)
+				continue;
+			for (int y = std::max(area.y, 0); y < std::min(area.y + area.height, height); y++)
+				for (int x = std::max(area.x, 0); x < std::min(area.x + area.width, width); x++)
+					sources[f][y * width + x] += emit[f] * sign;
+		}
+	}
+
+	//Run fn(first, last) over row bands
+	template<typename T>
+	void bands(T fn) {
+		int count = std::max(height / FIELD_BAND_ROWS, 1);
+		if (count == 1) {
+			fn(0, height);
+			return;
+		}
+		workers.run(count, [&](int b) {
+			fn(b * height / count, (b + 1) * height / count);
+		});
+	}
+
+	//Decay kept and source gain for n days at once, the sum of the decayed sources over those days
+	float decay[LOD_FIELD_CADENCE + 1], gain[LOD_FIELD_CADENCE + 1];
+
+	void inject(float *__restrict row, const float *__restrict srow, int count, int days) {
+		const float b = base, k = keep;
+		if (days == 1) {
+			for (int x = 0; x < count; x++)
+				row[x] = b + (row[x] + srow[x] - b) * k;
+			return;
+		}
+		const float a = decay[days], c = gain[days];
+		for (int x = 0; x < count; x++)
+			row[x] = b + (row[x] - b) * a + srow[x] * c;
+	}
+
+	//Inject, decay and blur the rows into scratch
+	void horizontal(int field, int first, int last) {
+		float *__restrict v = planes[field].data();
+		float *__restrict src = sources[field].data();
+		float *__restrict out = scratch[field].data();
+		for (int y = first; y < last; y++) {
+			int cy = y / LOD_CHUNK, cyAbove = std::max(y - 1, 0) / LOD_CHUNK, cyBelow = std::min(y + 1, height - 1) / LOD_CHUNK;
+			if (!lod.rowSteps[cy] && !lod.rowSteps[cyAbove] && !lod.rowSteps[cyBelow])
+				continue;
+			const int *days = &lod.fieldDays[cy * lod.chunksX];
+			const int *above = &lod.fieldDays[cyAbove * lod.chunksX];
+			const int *below = &lod.fieldDays[cyBelow * lod.chunksX];
+			float *row = v + y * width;
+			float *srow = src + y * width;
+			for (int cx = 0; cx < lod.chunksX; cx++)
+				if (days[cx])
+					inject(row + cx * LOD_CHUNK, srow + cx * LOD_CHUNK, std::min(LOD_CHUNK, width - cx * LOD_CHUNK), days[cx]);
+			//Only rows the vertical pass reads for a stepping chunk
+			float *orow = out + y * width;
+			for (int cx = 0; cx < lod.chunksX; cx++) {
+				if (!days[cx] && !above[cx] && !below[cx])
+					continue;
+				int x0 = cx * LOD_CHUNK;
+				int x1 = std::min(x0 + LOD_CHUNK, width);
+				for (int x = std::max(x0, 1); x < std::min(x1, width - 1); x++)
+					orow[x] = (row[x - 1] + row[x] * 2.0f + row[x + 1]) * 0.25f;
+				if (x0 == 0)
+					orow[0] = (row[0] * 3.0f + row[std::min(1, width - 1)]) * 0.25f;
+				if (x1 == width && width > 1)
+					orow[width - 1] = (row[width - 2] + row[width - 1] * 3.0f) * 0.25f;
+			}
+		}
+	}
+
+	//Blur the columns of scratch back into the plane
+	void vertical(int field, int first, int last) {
+		float *__restrict in = scratch[field].data();
+		float *__restrict v = planes[field].data();
+		for (int y = first; y < last; y++) {
+			const float *up = in + std::max(y - 1, 0) * width;
+			const float *mid = in + y * width;
+			const float *down = in + std::min(y + 1, height - 1) * width;
+			const int *days = &lod.fieldDays[(y / LOD_CHUNK) * lod.chunksX];
+			if (!lod.rowSteps[y / LOD_CHUNK])
+				continue;
+			float *row = v + y * width;
+			for (int cx = 0; cx < lod.chunksX; cx++) {
+				if (!days[cx])
+					continue;
+				int x0 = cx * LOD_CHUNK;
+				int x1 = std::min(x0 + LOD_CHUNK, width);
+				for (int x = x0; x < x1; x++) {
+					float value = (up[x] + mid[x] * 2.0f + down[x]) * 0.25f;
+					row[x] = value < 0.0f ? 0.0f : (value > 1.0f ? 1.0f : value);
+				}
+			}
+		}
+	}
+
+	//all steps every chunk, settling the days far chunks owe
+	void step(bool all) {
+		if (planes[0].empty())
+			return;
+		lod.fieldDay(all);
+		for (int d = 1; d <= LOD_FIELD_CADENCE; d++) {
+			decay[d] = powf(keep, d);
+			gain[d] = keep * (1.0f - decay[d]) / (1.0f - keep);
+		}
+		bands([&](int first, int last) {
+			for (int f = 0; f < FIELD_COUNT; f++)
+				horizontal(f, first, last);
+		});
+		bands([&](int first, int last) {
+			for (int f = 0; f < FIELD_COUNT; f++)
+				vertical(f, first, last);
+		});
+		publish();
+	}
+
+	plane_stats stats[FIELD_COUNT];
+	std::vector<plane_stats> bandStats[FIELD_COUNT];
+
+	//Bands with a row of chunks that stepped today, every band before the first step
+	bool bandChanged(int band) {
+		if (lod.rowSteps.empty())
+			return true;
+		int first = band * STATS_ROWS / LOD_CHUNK;
+		int last = std::min(((band + 1) * STATS_ROWS - 1) / LOD_CHUNK, (int)lod.rowSteps.size() - 1);
+		for (int c = first; c <= last; c++)
+			if (lod.rowSteps[c])
+				return true;
+		return false;
+	}
+
+	//The overlay globals are the map averages
+	void publish() {
+		for (int f = 0; f < FIELD_COUNT; f++) {
+			const float *v = planes[f].data();
+			stats[f] = reduce(width, height, [v](int i) { return v[i]; }, bandStats[f], [&](int b) { return bandChanged(b); });
+		}
+		environment = stats[FIELD_ENVIRONMENT].mean();
+		health = stats[FIELD_HEALTH].mean();
+		safety = stats[FIELD_SAFETY].mean();
+		traffic = stats[FIELD_TRAFFIC].mean();
+		education = stats[FIELD_EDUCATION].mean();
+		landvalue = stats[FIELD_LANDVALUE].mean();
+	}
+} fields;
+
 bool placementMode;
 bool waterView;
 bool infoMode;
@@ -129,6 +778,8 @@ bool statsMode;
 bool queryMode;
 bool plopsOnly;
 bool graphicsUpdate;
+dirty_region screenDirty; //Screen cells to draw again this frame
+posi renderOrigin = {0,0}; //Taken off render areas while drawing into an off-screen layer
 
 #pragma endregion
 
@@ -157,6 +808,11 @@ enum FLAG {
 #pragma region //Function parameters or basic structs
 /*
 Struct for data stored within the game engine tile map
+
+a[0] bits 0-3 connections, bits 4-5 underground
+a[1] bit 0 power, bit 1 water, bits 2-3 facing, bit 4 road access, bits 5-6 zone
+a[3] booleans, bit 6 is plop
+a[4] building id and animation, shared with the plop id in c[1]
 */
 struct tilePartial {
 	tilePartial() { id = 0; data.b = 0; }
@@ -168,7 +824,7 @@ struct tilePartial {
 	} data;
 	tilePartial transferProperties(tilePartial in) {
 		in.data.a[0] |= data.a[0] & 0b00110000;
-		in.data.a[1] |= data.a[1] & 0b00000011;
+		in.data.a[1] |= data.a[1] & 0b01100011;
 		in.data.a[2] |= data.a[2] & 0b00000011;
 		return in;
 	}
@@ -249,6 +905,13 @@ struct tilePartial {
 		data.a[1] &= data.a[1] ^ 2;
 		data.a[1] |= state ? 2 : 0;
 	}
+	int getZone() {
+		return (data.a[1] & 0b01100000) >> 5;
+	}
+	void setZone(int zone) {
+		data.a[1] &= data.a[1] ^ 0b01100000;
+		data.a[1] |= (zone & 0b11) << 5;
+	}
 };
 
 /*
@@ -414,7 +1077,7 @@ struct _game {
 	sizei mapSize;
 	sizei getMapSize() { return mapSize; }
 
-	void init(sizei size);
+	void init(sizei size, unsigned int seed);
 	std::vector<tileComplete> getTiles(sizei size);
 	std::vector<tilePartial*> getPartials(sizei size);
 	std::vector<piece> getPieces(sizei size);
@@ -470,85 +1133,208 @@ struct tileEventHandler {
 	virtual void onNetworkEvent(tileEvent e) {}
 };
 
-struct network_value {
-	network_value() {
-		supply = 0;
-		demand = 0;
-		stored = 0;
-		consumer = false;
-	}
-	network_value(net_t network_val):network_value() {
-		if (network_val > 0) {
-			supply = stored = network_val;
-			consumer = false;
+/*
+Storage for every network_value, one slot per participant
+
+Values are kept in parallel arrays so the per tick and per component
+work can run as flat loops instead of calls through each object
+*/
+struct network_table {
+	std::vector<net_t> supply, demand, stored;
+	std::vector<int> type;
+	std::vector<unsigned char> consumer, live;
+	std::vector<int> changed; //version at which each slot was last allocated or released
+	std::vector<int> freeSlots;
+	int version = 0;
+
+	int size() {
+		return supply.size();
+	}
+
+	int allocate(int flags, net_t sup, net_t dem, bool con) {
+		int slot;
+		if (!freeSlots.empty()) {
+			slot = freeSlots.back();
+			freeSlots.pop_back();
 		} else {
-			demand = -network_val;
-			stored = 0;
-			consumer = true;
+			slot = size();
+			supply.push_back(0);
+			demand.push_back(0);
+			stored.push_back(0);
+			type.push_back(0);
+			consumer.push_back(0);
+			live.push_back(0);
+			changed.push_back(0);
+		}
+		supply[slot] = sup;
+		demand[slot] = dem;
+		stored[slot] = con ? 0 : sup;
+		type[slot] = flags;
+		consumer[slot] = con;
+		live[slot] = 1;
+		changed[slot] = ++version;
+		return slot;
+	}
+
+	void release(int slot) {
+		if (slot < 0 || slot >= size() || !live[slot])
+			return;
+		supply[slot] = demand[slot] = stored[slot] = 0;
+		type[slot] = 0;
+		live[slot] = 0;
+		freeSlots.push_back(slot);
+		changed[slot] = ++version;
+	}
+
+	//Slot was allocated or released after since
+	bool changedSince(int slot, int since) {
+		return slot >= size() || changed[slot] > since;
+	}
+
+	net_t getSupply(int i) {
+		return getSupply(i, stored);
+	}
+
+	net_t getDemand(int i) {
+		return getDemand(i, stored);
+	}
+
+	/*
+	Kernels below work on a column shaped like stored,
+	either stored itself or a staged copy of it
+	*/
+	net_t getSupply(int i, std::vector<net_t> &values) {
+		return consumer[i] ? 0 : values[i];
+	}
+
+	net_t getDemand(int i, std::vector<net_t> &values) {
+		return consumer[i] ? demand[i] - values[i] : demand[i];
+	}
+
+	/*
+	TICK for every slot of a network type
+	Consumers drain by their demand, producers refill to supply
+	*/
+	void tick(int mask, std::vector<net_t> &values) {
+		int n = size();
+		//Raw scalars, so fixed point slots run as integer lanes
+		net_scalar *__restrict s = (net_scalar*)values.data();
+		const net_scalar *__restrict d = (const net_scalar*)demand.data();
+		const net_scalar *__restrict p = (const net_scalar*)supply.data();
+		const unsigned char *__restrict c = consumer.data();
+		const int *__restrict t = type.data();
+
+		//Loads are hoisted so the selects become vector blends
+		for (int i = 0; i < n; i++) {
+			net_scalar cur = s[i], sup = p[i], dem = d[i];
+			bool con = c[i], in = t[i] & mask;
+			net_scalar drained = cur - dem;
+			drained = drained > 0 ? drained : 0;
+			net_scalar next = con ? drained : sup;
+			s[i] = in ? next : cur;
 		}
 	}
-	network_value(net_t supply, net_t demand)
-	:supply(supply),demand(demand),stored(0),consumer(isDemand()) {}
+
+	net_t sumSupply(const std::vector<int> &slots, std::vector<net_t> &values) {
+		net_t sum = 0;
+		for (int i : slots)
+			sum += getSupply(i, values);
+		return sum;
+	}
+
+	net_t sumDemand(const std::vector<int> &slots, std::vector<net_t> &values) {
+		net_t sum = 0;
+		for (int i : slots)
+			sum += getDemand(i, values);
+		return sum;
+	}
+
+	//Every slot gives up the same fraction of its supply
+	void takeFraction(const std::vector<int> &slots, net_t fraction, std::vector<net_t> &values) {
+		for (int i : slots)
+			values[i] -= getSupply(i, values) * fraction;
+	}
+
+	//Every slot receives the same fraction of its demand
+	void giveFraction(const std::vector<int> &slots, net_t fraction, std::vector<net_t> &values) {
+		for (int i : slots)
+			values[i] += getDemand(i, values) * fraction;
+	}
+} networkTable;
+
+/*
+Handle to a slot in networkTable
+*/
+struct network_value {
+	network_value(int type = 0) {
+		slot = networkTable.allocate(type, 0, 0, false);
+	}
+	network_value(int type, net_t network_val) {
+		if (network_val > 0)
+			slot = networkTable.allocate(type, network_val, 0, false);
+		else
+			slot = networkTable.allocate(type, 0, -network_val, true);
+	}
+	network_value(int type, net_t supply, net_t demand) {
+		slot = networkTable.allocate(type, supply, demand, supply <= 0);
+	}
+	network_value(const network_value &) = delete;
+	network_value &operator=(const network_value &) = delete;
+
+	~network_value() {
+		networkTable.release(slot);
+	}
 
 	//Demand for network
-	virtual net_t getDemand() {
-		return consumer ? demand - stored : demand; 
+	net_t getDemand() {
+		return networkTable.getDemand(slot);
 	}
 	//Supply for network
-	virtual net_t getSupply() {
-		return consumer ? 0 : stored;
+	net_t getSupply() {
+		return networkTable.getSupply(slot);
 	}
 
-	virtual net_t give(net_t amount) {
+	net_t give(net_t amount) {
 		net_t need = getDemand();
 		if (amount > need) {
 			amount = need;
-			stored += amount;
+			networkTable.stored[slot] += amount;
 		} else {
-			stored += amount;
+			networkTable.stored[slot] += amount;
 			amount = 0;
 		}
 		return amount;
 	}
 
-	virtual net_t take(net_t amount) {
+	net_t take(net_t amount) {
 		net_t have = getSupply();
 		if (amount > have) {
 			amount = have;
-			stored = 0;
+			networkTable.stored[slot] = 0;
 		} else {
-			stored -= amount;
+			networkTable.stored[slot] -= amount;
 		}
 		return amount;
 	}
 
-	virtual bool isSupply() {
-		return !consumer;
+	bool isSupply() {
+		return !networkTable.consumer[slot];
 	}
 
-	virtual bool isDemand() {
-		return consumer;
+	bool isDemand() {
+		return networkTable.consumer[slot];
 	}
 
-	virtual bool isSaturated() {
+	bool isSaturated() {
 		return getSupply() == getDemand();
 	}
 
-	virtual void onNetworkEvent(tileEvent e) {
-		fprintf(logFile, "onNetworkEvent: %i %p %f %f %f %s\n", e.flags, this, supply, demand, stored, consumer ? "consumer" : "producer");
-		if (e.flags & TICK) {
-			if (consumer)
-				stored = stored - demand < 0 ? 0 : stored - demand;
-			else
-				stored = supply;
-		}
+	int getSlot() {
+		return slot;
 	}
 
 	private:
-	net_t supply;
-	net_t stored;
-	net_t demand;
-	bool consumer;
+	int slot;
 };
 
 struct network_provider {
@@ -603,15 +1389,6 @@ struct network_provider {
 			return wealth;
 		return nullptr;
 	}
-
-	virtual void onNetworkEvent(tileEvent e) {
-		//fprintf(logFile, "onNetworkEvent: %i %p ", e.flags, this);
-		for (network_value *value : getList()) {
-			//fprintf(logFile, "%p ", value);
-			value->onNetworkEvent(e);
-		}
-		//fprintf(logFile, "\n");
-	}
 };
 
 network_provider no_provider;
@@ -647,6 +1424,9 @@ struct tileBase : public tileEventHandler {
 		renderbox.width = aspect.x;
 		renderbox.height = aspect.y;
 
+		renderbox.x -= renderOrigin.x;
+		renderbox.y -= renderOrigin.y;
+
 		return renderbox;
 	}
 	virtual sizei getRenderArea(tileEvent e) {
@@ -704,11 +1484,6 @@ struct tileBase : public tileEventHandler {
 	virtual network_provider *getNetworkProvider(tileEvent e) {
 		return nullptr;
 	}
-	void onNetworkEvent(tileEvent e) override {
-		network_provider *net = getNetworkProvider(e);
-		if (net != nullptr)
-			net->onNetworkEvent(e);
-	}
 	virtual plop *getPlop(tileEvent e) {
 		if (e.partial->isPlop() && e.partial->getPlopId() == id)
 			return (plop*)registry.getInstance(e.partial->getPlopId());
@@ -820,31 +1595,7 @@ struct tile : public tileBase {
 				break;
 		}
 
-		sizei area = getRenderArea(e);
-		int state = (hflip << 1) | vflip;
-
-		if (mainTarget->is_retained_mode()) {
-			sizei retained_pos = {{0,0}, area.length()};
-			posi weird_offset = {0, area.height-1};
-			sizei weird_size = weird_offset.with(retained_pos.length().add(0, 0));
-			buffer_target *acceptor = (buffer_target*)mainTarget;
-			retained_target *retained = make_or_get_retained_target(&tex, retained_pos, state);
-
-			if (retained->shouldUpdate()) {
-				retained->clear();
-				tex.draw(weird_size, retained, hflip, vflip);
-				retained->stale = false;
-				acceptor->stale = true;
-			}
-
-			retained->render = true;
-
-			if (acceptor->shouldUpdate()) {
-				acceptor->draw(retained, area.start().sub(weird_offset));
-			}
-		} else {
-			tex.draw(area, mainTarget, hflip, vflip);
-		}
+		tex.draw_retained(getRenderArea(e), mainTarget, hflip, vflip);
 	}
 
 	void copyState(tilePartial *tile) override {
@@ -893,7 +1644,7 @@ struct tileable : public tile {
 	void render(tileEvent e) override {
 		bool con[4];
 		getConnections(e, &con[0]);
-		tex_connecting.draw_connections(getRenderArea(e), mainTarget, &con[0]);
+		tex_connecting.draw_connections_retained(getRenderArea(e), mainTarget, &con[0]);
 	}
 
 	tileBase *clone() override {
@@ -947,7 +1698,10 @@ struct plop : public tileBase {
 		if (!(rendererPos == renderingPos))
 			return;
 
-		tex->draw(tileBase::getRenderArea(size), mainTarget);
+		tex->draw_retained(tileBase::getRenderArea(size), mainTarget);
+
+		if (needsRoad() && !e.partial->hasRoad())
+			no_road_sprite.draw_retained(tileBase::getRenderArea(sizei(renderingPos.x, renderingPos.y, 1, 1)), mainTarget);
 	}	
 
 	tilePartial getDefaultState() override {
@@ -1016,21 +1770,65 @@ struct plop : public tileBase {
 		return net;
 	}
 
-	void onNetworkEvent(tileEvent e) override {
-		//fprintf(logFile, "plop::onNetworkEvent: %i %p \n", e.flags, this);
-		if (net != nullptr)
-			net->onNetworkEvent(e);
-	}
-
 	void onPlaceEvent(tileEvent e) override {
 		fprintf(logFile, "plop::onPlaceEvent %p %p %i %i %i\n", this, net, size.x, size.y, id);
 
 	}
 
+	//Service this plop provides, -1 for none
+	virtual int getService() {
+		return -1;
+	}
+
+	//Zoned buildings and services need a road within reach
+	bool needsRoad() {
+		return typeId != TRAFFIC_ROAD && (zone != ZONING_NONE || getService() != -1);
+	}
+
+	//What the plop adds to each field per step, per tile
+	virtual void getEmission(float *emit) {
+		for (int f = 0; f < FIELD_COUNT; f++)
+			emit[f] = 0.0f;
+		switch (zone) {
+			case ZONING_RESIDENTIAL:
+				emit[FIELD_SAFETY] = -0.01f;
+				emit[FIELD_LANDVALUE] = 0.01f;
+				break;
+			case ZONING_COMMERCIAL:
+				emit[FIELD_TRAFFIC] = 0.02f;
+				emit[FIELD_LANDVALUE] = 0.02f;
+				emit[FIELD_SAFETY] = -0.02f;
+				break;
+			case ZONING_INDUSTRIAL:
+				emit[FIELD_ENVIRONMENT] = -0.05f;
+				emit[FIELD_HEALTH] = -0.02f;
+				emit[FIELD_LANDVALUE] = -0.02f;
+				break;
+		}
+	}
+
+	plop *setZone(int zone, int capacity) {
+		this->zone = zone;
+		this->capacity = capacity;
+		return this;
+	}
+
+	//Move occupants in or out, keeps the demand totals current
+	void setPopulation(int value) {
+		value = std::min(std::max(value, 0), capacity);
+		if (value != population && (value == 0 || value == capacity))
+			markLot(size.x, size.y);
+		demandTotals.occupy(zone, size.x, size.y, value - population);
+		population = value;
+	}
+
 	int initial_id;
 	sizei size;
 	sprite *tex;
 	network_provider *net;
+	int zone = ZONING_NONE;
+	int capacity = 0;
+	int population = 0;
 };
 
 struct plop_connecting : public plop {
@@ -1045,7 +1843,7 @@ struct plop_connecting : public plop {
 	void render(tileEvent e) override {
 		bool con[4];
 		e.plop_instance->getConnections(e, &con[0]);
-		((simple_connecting_sprite*)tex)->draw_connections(getRenderArea(e), mainTarget, &con[0]);
+		((simple_connecting_sprite*)tex)->draw_connections_retained(getRenderArea(e), mainTarget, &con[0]);
 	}
 };
 
@@ -1062,10 +1860,16 @@ struct traffic_plop : public plop {
 		return (tc.plop_instance && tc.plop_instance->typeId == typeId);
 	}
 
+	void getEmission(float *emit) override {
+		plop::getEmission(emit);
+		emit[FIELD_TRAFFIC] = 0.01f;
+		emit[FIELD_ENVIRONMENT] = -0.005f;
+	}
+
 	void render(tileEvent e) override {
 		bool con[4];
 		e.plop_instance->getConnections(e, &con[0]);
-		((simple_connecting_sprite*)tex)->draw_connections(getRenderArea(e), mainTarget, &con[0]);
+		((simple_connecting_sprite*)tex)->draw_connections_retained(getRenderArea(e), mainTarget, &con[0]);
 	}
 
 	tileBase *clone() override {
@@ -1080,8 +1884,8 @@ struct traffic_plop : public plop {
 struct network_provider_plop : public plop {
 	network_provider_plop(sprite *tex, net_t water, net_t power, int plop_width = 1, int plop_height = 1, bool placeable=false):plop(tex,plop_width,plop_height,placeable) {
 		this->net = new network_provider();
-		this->net->water = new network_value(_water = water);
-		this->net->power = new network_value(_power = power);		
+		this->net->water = new network_value(WATER, _water = water);
+		this->net->power = new network_value(POWER, _power = power);		
 		//fprintf(logFile, "Network provider plop created: %p %p %p %f %f\n", this->net, this->net->water, this->net->power, water, power);
 	}
 
@@ -1101,17 +1905,12 @@ struct network_provider_plop : public plop {
 		return net;
 	}
 
-	void onNetworkEvent(tileEvent e) override {
-		//fprintf(logFile, "network_provider_plop::onNetworkEvent %p %p\n", this, net);
-		plop::onNetworkEvent(e);
-	}
-
 
 	tileBase *clone() override {
 		network_provider_plop* p = (network_provider_plop*)plop::clone<network_provider_plop>(this);
 		p->net = new network_provider();
-		p->net->water = new network_value(_water);
-		p->net->power = new network_value(_power);
+		p->net->water = new network_value(WATER, _water);
+		p->net->power = new network_value(POWER, _power);
 		//fprintf(logFile, "clone network_provider_plop %i %p %p %p %p %p %f\n", p->id, this, registry.getInstance(p->id), p, p->net, p->net->water, p->net->water->getSupply());
 		return p;
 	}
@@ -1123,8 +1922,8 @@ network_provider_plop water_tower_plop(&water_tower_sprite, 1200.0f, -100.0f, 1,
 network_provider_plop water_well_plop(&water_well_sprite, 500.0f, -50.0f, 1, 1, true);
 network_provider_plop water_pump_large_plop(&large_water_pump_sprite, 24000.0f, -400.0f, 2, 1, true);
 
-traffic_plop road_plop(&road_con_tex_sprite, 1);
-traffic_plop street_plop(&street_con_tex_sprite, 1);
+traffic_plop road_plop(&road_con_tex_sprite, TRAFFIC_ROAD);
+traffic_plop street_plop(&street_con_tex_sprite, TRAFFIC_ROAD);
 plop_connecting pool_plop(&pool_con_tex_sprite);
 
 network_provider_plop tall_building_plop(&tall_building_sprite, -800, -400, 1, 1, true);
@@ -1133,8 +1932,36 @@ plop building2_plop(&building2_sprite, 2, 1);
 plop building3_plop(&building3_sprite, 2, 2);
 plop building4_plop(&building4_sprite, 1, 1);
 
+struct service_plop : public plop {
+	service_plop(sprite *tex, int service, int plop_width = 1, int plop_height = 1, bool placeable=true):plop(tex,plop_width,plop_height,placeable) {
+		this->service = service;
+	}
+
+	int getService() override {
+		return service;
+	}
+
+	tileBase *clone() override {
+		return plop::clone<service_plop>(this);
+	}
+
+	int service;
+};
+
+service_plop clinic_plop(&building1_sprite, SERVICE_CLINIC);
+service_plop school_plop(&building2_sprite, SERVICE_SCHOOL, 2, 1);
+service_plop police_plop(&building4_sprite, SERVICE_POLICE);
+
 tilePartial partially_garbage;
 
+void init_plops() {
+	building1_plop.setZone(ZONING_RESIDENTIAL, 8);
+	building2_plop.setZone(ZONING_RESIDENTIAL, 20);
+	building3_plop.setZone(ZONING_INDUSTRIAL, 40);
+	building4_plop.setZone(ZONING_COMMERCIAL, 6);
+	tall_building_plop.setZone(ZONING_COMMERCIAL, 60);
+}
+
 struct selector : public tile {	
 	selector():selected(nullptr, &state, sizei(0,0,1,1)) {
 		selectedId = 0;
@@ -1196,15 +2023,15 @@ struct selector : public tile {
 		sizei area = getRenderArea(selected);
 
 		if (ticks++ % 20 > 9) {
-			selector_sprite.draw(area, mainTarget);
+			selector_sprite.draw_retained(area, mainTarget);
 			game.tileAreaLoop(selected.size, [&](posi p) {
-				selector_sprite.draw(getRenderArea(getEvent(p.with(1,1))), mainTarget);
+				selector_sprite.draw_retained(getRenderArea(getEvent(p.with(1,1))), mainTarget);
 			});
 		}
 
 		if (waterView) {
 			game.tileAreaLoop(selected.size, [&](posi p) {
-				water_pipe_sprite.draw(getRenderArea(getEvent(p.with(1,1))), mainTarget);
+				water_pipe_sprite.draw_retained(getRenderArea(getEvent(p.with(1,1))), mainTarget);
 			});
 			//water_pipe_sprite.draw(area);
 		} else {
@@ -1271,15 +2098,15 @@ struct _dirt_tile : public tile {
 		if (e.plop_instance) {
 			network_value *water = getNetwork(e.with(0,SILENT), WATER);
 			if (water && water->isSupply())
-				wet_plop_sprite.draw(area, mainTarget);
+				wet_plop_sprite.draw_retained(area, mainTarget);
 			else
-				dry_plop_sprite.draw(area, mainTarget);
+				dry_plop_sprite.draw_retained(area, mainTarget);
 				
 		} else {
 			if (e.partial->hasWater())
-				wet_dirt_sprite.draw(area, mainTarget);
+				wet_dirt_sprite.draw_retained(area, mainTarget);
 			else
-				dry_dirt_sprite.draw(area, mainTarget);
+				dry_dirt_sprite.draw_retained(area, mainTarget);
 		}
 	}
 };
@@ -1292,10 +2119,12 @@ struct _water_pipe_tile : public tileable {
 	}
 	
 	void onPlaceEvent(tileEvent e) override {
+		markRowsEdited(e.size);
 		e.partial->setUnderground(UNDERGROUND_WATER_PIPE);
 	}
 
 	void onDestroyEvent(tileEvent e) override {
+		markRowsEdited(e.size);
 		e.partial->setUnderground(0);
 	}
 };
@@ -1306,371 +2135,2297 @@ tile grass_tile = tile(grass_sprite, true);
 tile sand_tile = tile(sand_sprite, true);
 tile water_tile = tile(wet_plop_sprite, true);
 _dirt_tile dirt_tile;
-selector tileSelector;
 
-#pragma endregion
+/*
+Zoned lot, the zone is kept in the tile bits so buildings can come and go on it
+Each zone draws the ground tinted in its own color
+*/
+struct _zone_tile : public tile {
+	_zone_tile(tinted_sprite *zoneTex, int zone) :tile(*zoneTex, true),zoneTex(zoneTex),zone(zone) {}
 
-#pragma region //Functions not forward declared
+	tinted_sprite *zoneTex; //tex is a copy without the tint
+	int zone;
 
-std::vector<tileComplete> walk_network(tileComplete current, bool(*meetsCriteria)(tileComplete), std::vector<tileComplete> &network) {
-	if (std::find(network.begin(), network.end(), current) != network.end())
-		return network;
+	void render(tileEvent e) override {
+		if (e.plop_instance)
+			dry_plop_sprite.draw_retained(getRenderArea(e), mainTarget);
+		else
+			zoneTex->draw_retained(getRenderArea(e), mainTarget);
+	}
 
-	if (current.partial == nullptr)
-		return network;
+	void copyState(tilePartial *tile) override {
+		tile->id = id;
+		tile->setZone(zone);
+	}
 
-	network.push_back(current);
+	void onPlaceEvent(tileEvent e) override {
+		markLot(e.size.x, e.size.y);
+	}
+};
 
-	posi p = current.size;
+_zone_tile residential_zone_tile(&residential_zone_sprite, ZONING_RESIDENTIAL);
+_zone_tile commercial_zone_tile(&commercial_zone_sprite, ZONING_COMMERCIAL);
+_zone_tile industrial_zone_tile(&industrial_zone_sprite, ZONING_INDUSTRIAL);
+_zone_tile *zoneTiles[4] = { nullptr, &residential_zone_tile, &commercial_zone_tile, &industrial_zone_tile };
+selector tileSelector;
 
-	tileComplete q[4] = {
-		getComplete(p.north()),
-		getComplete(p.east()),
-		getComplete(p.south()),
-		getComplete(p.west())
-	};
+#pragma endregion
 
-	for (int i = 0; i < 4; i++) {
-		if (game.isInBounds(q[i].size) && meetsCriteria(q[i])) {
-			walk_network(q[i], meetsCriteria, network);
-		}
-	}
-
-	return network;
-}
+#pragma region //Functions not forward declared
 
 bool isWaterNetwork(tileComplete tc) {
 	return tc.partial->hasUnderground(UNDERGROUND_WATER_PIPE);
 }
 
-template<typename FUNCTION>
-network_summary balanceNetworks(FLAG type, FUNCTION func) {
-	std::vector<tileComplete> sparse;
-	sizei map = game.getMapSize();
-	network_summary sm;
+/*
+Single pass supply allocation for one network component
 
-	//Values are changing
-	game.fireEvent(map, NETWORK, type|TICK);
+Every consumer receives the same fraction of its demand and every
+provider gives up the same fraction of its supply, so the result
+does not depend on the order participants were discovered in.
+Each slot belongs to one allocation, the job merges components
+that reach the same slot
+*/
+struct network_allocation {
+	network_allocation(std::vector<net_t> *values) : values(values) {}
 
-	//Take network tiles
-	game.tileAreaLoop(map, [&](posi p) {
-		tileEvent e = getComplete(p);
-		network_value *v = getNetwork(e.with(0,SILENT), type);
-		if (v == nullptr)
-			return;
-		if (v->isSupply()) {
-			if (std::find(sparse.begin(), sparse.end(), e) != sparse.end())
-				return;
-			sparse.push_back(e);
-			fprintf(logFile, "Network piece: %i %i %f %f\n", p.x, p.y, v->getSupply(), v->getDemand());
-		}
-	});
+	std::vector<net_t> *values;
+	std::vector<int> providers, consumers;
+	net_t input = 0;
+	net_t output = 0;
 
-	std::vector<std::vector<tileComplete>> networks;
+	void add(network_value *v) {
+		if (v->isSupply())
+			providers.push_back(v->getSlot());
+		else
+			consumers.push_back(v->getSlot());
+	}
 
-	//Walk present networks
-	for (tileComplete tc : sparse) {
-		bool newNetwork = true;
-		
-		for (auto network : networks) {
-			if (std::find(network.begin(), network.end(), tc) != network.end()) {
-				newNetwork = false;
-				break;
-			}
-		}
+	//Take every participant of another component
+	void merge(network_allocation &other) {
+		providers.insert(providers.end(), other.providers.begin(), other.providers.end());
+		consumers.insert(consumers.end(), other.consumers.begin(), other.consumers.end());
+		other.providers.clear();
+		other.consumers.clear();
+	}
 
-		if (newNetwork) {
-			std::vector<tileComplete> network;
-			walk_network(tc, func, network);
-			networks.push_back(network);
-			sm.networks++;
-		}
+	//Component totals, call once participants are added
+	void total() {
+		input = networkTable.sumSupply(providers, *values);
+		output = networkTable.sumDemand(consumers, *values);
+	}
+
+	net_t getDemand() {
+		return output;
 	}
 
-	//Balance networks
-	for (auto network : networks) {
-		std::vector<tileComplete> consumers, providers;
-		net_t input = 0, output = 0;
+	//Returns amount of supply handed out
+	net_t solve() {
+		if (input <= 0 || output <= 0)
+			return 0;
 
-		for (tileEvent e : network) {
-			game.tileRadiusLoop(e.size, 5, [&](posi p) {
-				tileEvent e2 = getComplete(p);
-				network_value *consum = getNetwork(e2.with(0, SILENT), type);
+		net_t used = input < output ? input : output;
+		networkTable.takeFraction(providers, used / input, *values);
+		networkTable.giveFraction(consumers, used / output, *values);
 
-				if (consum && consum->isDemand())
-					if (std::find(consumers.begin(), consumers.end(), e2) == consumers.end()) {
-						output += consum->getDemand();
-						consumers.push_back(e2);
-					}
-			});
+		return used;
+	}
+};
 
-			network_value *net = getNetwork(e.with(0, SILENT), type);
+#define NETWORK_HISTOGRAM_BUCKETS 8
 
-			if (net && net->isSupply())
-				if (std::find(providers.begin(), providers.end(), e) == providers.end()) {
-					input += net->getSupply();
-					providers.push_back(e);
-				}
-		}
+long long elapsedMicros(std::chrono::steady_clock::time_point since) {
+	return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - since).count();
+}
 
-		if (providers.empty())
-			continue;
+/*
+Adds time spent in a scope to a counter
+*/
+struct scope_timer {
+	scope_timer(long long &counter) : counter(counter), begin(std::chrono::steady_clock::now()) {}
+	~scope_timer() {
+		counter += elapsedMicros(begin);
+	}
+	long long &counter;
+	std::chrono::steady_clock::time_point begin;
+};
 
-		fprintf(logFile, "This network: %li %li %f %f\n", providers.size(), consumers.size(), input, output);
+/*
+Counters for one network solve
+Times are microseconds, histogram bucket i holds components of 2^i to 2^(i+1)-1 tiles
+*/
+struct network_stats {
+	long long tick = 0, discover = 0, walk = 0, consumers = 0, allocate = 0;
+	long long duration = 0;
+	int frames = 0;
+	int restarts = 0; //Passes thrown away before this one finished
+	int components = 0, tiles = 0, providers = 0, users = 0;
+	int histogram[NETWORK_HISTOGRAM_BUCKETS] = {};
 
-		sm.demand += output;
-		sm.supply += input;
+	long long active() {
+		return tick + discover + walk + consumers + allocate;
+	}
 
-		net_t ratio = input / output;
-		if (ratio == 0 || ratio < 0 || output < 0.1)
-			continue;
-		float maxRadius = 5.0f;
-		float radius = ratio * maxRadius;
-		if (radius < 0)
-			radius = 0;
-		if (radius > maxRadius)
-			radius = maxRadius;
+	void addComponent(int size) {
+		int bucket = 0;
+		while ((size >>= 1) && bucket < NETWORK_HISTOGRAM_BUCKETS - 1)
+			bucket++;
+		histogram[bucket]++;
+		components++;
+	}
 
-		for (tileEvent e : providers) {
-			network_value *net = getNetwork(e.with(0, SILENT), type);
-			if (net && net->isSupply())
-				net->take(ratio > 1 ? net->getSupply() : net->getSupply() / ratio);
+	void dump(FILE *f, const char *name) {
+		fprintf(f, "{\"network\":\"%s\",\"tick_us\":%lli,\"discover_us\":%lli,\"walk_us\":%lli,\"consumers_us\":%lli,\"allocate_us\":%lli,\"active_us\":%lli,\"duration_us\":%lli,\"frames\":%i,\"restarts\":%i,\"components\":%i,\"tiles\":%i,\"providers\":%i,\"consumers\":%i,\"histogram\":[",
+			name, tick, discover, walk, consumers, allocate, active(), duration, frames, restarts, components, tiles, providers, users);
+		for (int i = 0; i < NETWORK_HISTOGRAM_BUCKETS; i++)
+			fprintf(f, i ? ",%i" : "%i", histogram[i]);
+		fprintf(f, "]}\n");
+	}
+};
 
+/*
+Network solve that can be spread over many frames
+
+Phases run in order: discover supply tiles, walk each component,
+look up consumers around the component, allocate. Values are ticked
+and allocated on a staged copy of the table which is committed in
+one step at the end. Values created while the job runs join the next
+one. If a value the job already counted is removed or replaced, the
+staged results are thrown away and the job restarts
+*/
+struct network_job {
+	enum PHASE { IDLE, DISCOVER, WALK, CONSUMERS, ALLOCATE };
+
+	FLAG type;
+	bool (*meetsCriteria)(tileComplete);
+	int phase = IDLE;
+	int version, checked;
+	sizei map;
+
+	std::vector<net_t> staged;
+	std::vector<posi> sparse;
+	std::vector<unsigned char> visited;
+	std::vector<std::vector<posi>> networks;
+	std::vector<network_allocation> allocations;
+	std::vector<int> owner; //Component that took each slot, -1 for none
+	std::vector<int> joined; //Union find over components that reach the same slot
+	network_summary working, result;
+	network_stats stats, lastStats;
+	std::chrono::steady_clock::time_point started;
+
+	//Resume points
+	int cursor, component, piece;
+
+	bool isRunning() {
+		return phase != IDLE;
+	}
+
+	const char *getName() {
+		return type & WATER ? "water" : type & POWER ? "power" : "other";
+	}
+
+	void start(FLAG type, bool (*meetsCriteria)(tileComplete)) {
+		this->type = type;
+		this->meetsCriteria = meetsCriteria;
+		map = game.getMapSize();
+		version = checked = networkTable.version;
+		stats = network_stats();
+		started = std::chrono::steady_clock::now();
+
+		//Values are changing
+		{
+			scope_timer timer(stats.tick);
+			staged = networkTable.stored;
+			networkTable.tick(type, staged);
 		}
 
-		for (tileEvent e : consumers) {
-			network_value *net = getNetwork(e.with(0, SILENT), type);
-			if (net && net->isDemand()) 
-				input -= net->give(input);
+		sparse.clear();
+		networks.clear();
+		allocations.clear();
+		owner.assign(staged.size(), -1);
+		joined.clear();
+		visited.assign(map.area(), 0);
+		working = network_summary();
+		cursor = component = piece = 0;
+		phase = DISCOVER;
+	}
+
+	void restart() {
+		int restarts = stats.restarts + 1;
+		start(type, meetsCriteria);
+		stats.restarts = restarts;
+	}
+
+	//Any slot already in a component changed since the job started
+	bool countedChanged() {
+		for (network_allocation &alloc : allocations) {
+			for (int slot : alloc.providers)
+				if (networkTable.changedSince(slot, version))
+					return true;
+			for (int slot : alloc.consumers)
+				if (networkTable.changedSince(slot, version))
+					return true;
 		}
+		return false;
+	}
 
-		sm.used = sm.supply - input;
+	//Slots newer than the staged copy wait for the next job
+	bool counts(network_value *v) {
+		return v != nullptr && !networkTable.changedSince(v->getSlot(), version);
 	}
 
-	fprintf(logFile, "Balanced\n");
+	int root(int c) {
+		while (joined[c] != c)
+			c = joined[c] = joined[joined[c]];
+		return c;
+	}
 
-	//Values are changing
-	//game.fireEvent(map, NETWORK, type|TICK);
+	//First component to reach a slot takes it, a later one is joined to that one
+	void take(network_value *v, int c) {
+		int &o = owner[v->getSlot()];
+		if (o == -1) {
+			o = c;
+			allocations[c].add(v);
+			return;
+		}
+		int a = root(o), b = root(c);
+		if (a != b)
+			joined[std::max(a, b)] = std::min(a, b);
+	}
 
-	return sm;
-}
+	/*
+	Run until finished or budget microseconds have passed
+	Budget of 0 or less runs to completion
+	Returns true when results were committed by this call
+	*/
+	bool step(int budget) {
+		if (phase == IDLE)
+			return false;
+
+		auto begin = std::chrono::steady_clock::now();
+		int work = 0;
+		auto outOfTime = [&]() {
+			if (budget <= 0 || ++work % 64 != 0)
+				return false;
+			return elapsedMicros(begin) >= budget;
+		};
 
-#pragma endregion
+		if (!(game.getMapSize() == map)) {
+			restart();
+		} else if (networkTable.version != checked) {
+			checked = networkTable.version;
+			if (countedChanged())
+				restart();
+		}
 
-#pragma region //Function implementations that are forward declared
+		stats.frames++;
 
-template<template<typename> typename POS, typename T1, typename FUNCTION>
-void util::areaLoop(POS<T1> size, FUNCTION func) {
-	for (int x = size.x; x < size.x + size.width; x++) {
-		for (int y = size.y; y < size.y + size.height; y++) {
-			POS<T1> target(x,y);
-			func(target);
+		if (phase == DISCOVER) {
+			scope_timer timer(stats.discover);
+			while (phase == DISCOVER) {
+				if (cursor >= map.area()) {
+					phase = WALK;
+					cursor = 0;
+					break;
+				}
+				posi p(cursor % map.width, cursor / map.width);
+				cursor++;
+				tileEvent e = getComplete(p);
+				network_value *v = getNetwork(e.with(0,SILENT), type);
+				if (counts(v) && v->isSupply()) {
+					sparse.push_back(p);
+					fprintf(logFile, "Network piece: %i %i %f %f\n", p.x, p.y, netf(networkTable.getSupply(v->getSlot(), staged)), netf(networkTable.getDemand(v->getSlot(), staged)));
+				}
+				if (outOfTime())
+					return false;
+			}
 		}
-	}
-}
 
-template<template<typename> typename POS, typename T1, typename T2,typename FUNCTION>
-void util::radiusLoop(POS<T1> p, T2 radius, FUNCTION func) {
-	for (T1 x = p.x - radius; x < p.x + radius; x++) {
-		for (T1 y = p.y - radius; y < p.y + radius; y++) {
-			POS<T1> target(x,y);
-			if (p.distsq(target) < radius * radius)
-				func(target);
+		//Breadth first, one seed per step
+		if (phase == WALK) {
+			scope_timer timer(stats.walk);
+			while (phase == WALK) {
+				if (cursor >= (int)sparse.size()) {
+					phase = CONSUMERS;
+					component = piece = 0;
+					break;
+				}
+				posi seed = sparse[cursor++];
+				if (visited[seed.y * map.width + seed.x])
+					continue;
+
+				std::vector<posi> network;
+				visited[seed.y * map.width + seed.x] = 1;
+				network.push_back(seed);
+				for (size_t head = 0; head < network.size(); head++) {
+					posi q[4] = {
+						network[head].north(),
+						network[head].east(),
+						network[head].south(),
+						network[head].west()
+					};
+					for (int i = 0; i < 4; i++) {
+						if (!game.isInBounds(q[i]))
+							continue;
+						unsigned char &seen = visited[q[i].y * map.width + q[i].x];
+						if (seen || !meetsCriteria(getComplete(q[i])))
+							continue;
+						seen = 1;
+						network.push_back(q[i]);
+					}
+				}
+				joined.push_back(networks.size());
+				networks.push_back(network);
+				allocations.push_back(network_allocation(&staged));
+				working.networks++;
+				stats.addComponent(network.size());
+				stats.tiles += network.size();
+
+				if (outOfTime())
+					return false;
+			}
 		}
-	}
-}
 
-bool _game::isInRadius(int ox, int oy, int px, int py, float r) {
-	return isInRadius({ox,oy,px,py}, r);
-}
+		if (phase == CONSUMERS) {
+			scope_timer timer(stats.consumers);
+			while (phase == CONSUMERS) {
+				if (component >= (int)networks.size()) {
+					//Components sharing a slot are solved as one
+					for (int c = 0; c < (int)allocations.size(); c++)
+						if (root(c) != c)
+							allocations[root(c)].merge(allocations[c]);
+					phase = ALLOCATE;
+					component = 0;
+					break;
+				}
+				if (piece >= (int)networks[component].size()) {
+					component++;
+					piece = 0;
+					continue;
+				}
 
-bool _game::isInRadius(sizei size, float r) {
-	return size.distsq() < r * r;
-}
+				tileEvent e = getComplete(networks[component][piece++]);
 
-bool _game::isInBounds(posi p) {
-	return isInBounds(p.with(1,1));
-}
+				game.tileRadiusLoop(e.size, 5, [&](posi p) {
+					tileEvent e2 = getComplete(p);
+					network_value *consum = getNetwork(e2.with(0, SILENT), type);
 
-bool _game::isInBounds(sizei p) {
-	return getMapSize().contains(p);
-}
+					if (counts(consum) && consum->isDemand())
+						take(consum, component);
+				});
 
-template<typename FUNCTION, typename Tradius>
-void _game::tileRadiusLoop(posi p, Tradius radius, FUNCTION func) {
-	util::radiusLoop(p, radius, [&](posi target) {
-		if (isInBounds(target))
-			func(target);
-	});
-}
+				network_value *net = getNetwork(e.with(0, SILENT), type);
 
-template<typename FUNCTION, typename Tradius>
-void _game::tileRadiusLoop(int x, int y, Tradius radius, FUNCTION func) {
-	tileRadiusLoop(posi(x,y), radius, func);
-}
+				if (counts(net) && net->isSupply())
+					take(net, component);
 
-template<typename FUNCTION>
-void _game::tileAreaLoop(sizei size, FUNCTION func) {
-	util::areaLoop(size, [&](posi p) {
-		if (isInBounds(p))
-			func(p);
-	});
-}
+				if (outOfTime())
+					return false;
+			}
+		}
 
-std::vector<tileComplete> _game::getTiles(sizei size) {
-	std::vector<tileComplete> tiles;
+		if (phase == ALLOCATE) {
+			scope_timer timer(stats.allocate);
+			while (phase == ALLOCATE) {
+				if (component >= (int)allocations.size())
+					break;
 
-	if (size.width == 1 && size.height == 1) {
-		tiles.push_back(getComplete(size));
-		return tiles;
-	}
+				network_allocation &alloc = allocations[component++];
 
-	for (int x = size.x; x < size.x + size.width; x++) {
-		for (int y = size.y; y < size.y + size.height; y++) {
-			tiles.push_back(getComplete(x,y));
-		}
-	}
+				if (alloc.providers.empty())
+					continue;
 
-	return tiles;
-}
+				alloc.total();
+				net_t output = alloc.getDemand();
 
-std::vector<tilePartial*> _game::getPartials(sizei size) {
-	std::vector<tilePartial*> tiles;
+				fprintf(logFile, "This network: %li %li %f %f\n", alloc.providers.size(), alloc.consumers.size(), netf(alloc.input), netf(output));
 
-	if (size.width == 1 && size.height == 1) {
-		tiles.push_back(getPartial(size));
-		return tiles;
-	}
+				working.demand += output;
+				working.supply += alloc.input;
+				working.used += alloc.solve();
+				stats.providers += alloc.providers.size();
+				stats.users += alloc.consumers.size();
 
-	for (int x = size.x; x < size.x + size.width; x++) {
-		for (int y = size.y; y < size.y + size.height; y++) {
-			tiles.push_back(getPartial(x,y));
+				if (outOfTime())
+					return false;
+			}
 		}
-	}
 
-	return tiles;
-}
+		if (phase == ALLOCATE) {
+			commit();
+			return true;
+		}
 
-void _game::fireEvent(sizei size, int events) {
-	fireEvent(getEvent(size), events);
-}
+		return false;
+	}
 
-void _game::fireEvent(tileEvent e, int events) {
-	fireEvent(e.with(events));
-}
+	void commit() {
+		if (networkTable.version == version) {
+			networkTable.stored.swap(staged);
+		} else {
+			//Values created or released meanwhile keep what they have
+			for (int i = 0; i < (int)staged.size(); i++)
+				if (!networkTable.changedSince(i, version))
+					networkTable.stored[i] = staged[i];
+		}
+		result = working;
+		stats.duration = elapsedMicros(started);
+		lastStats = stats;
+		phase = IDLE;
+		fprintf(logFile, "Balanced\n");
+		lastStats.dump(logFile, getName());
+	}
+} waterJob;
 
-void _game::fireEvent(sizei size, int events, int flags) {
-	fireEvent(getEvent(size).with(events,flags));
-}
+/*
+Road tiles as graph nodes with a fixed stride of 4 neighbours (north, east, south, west)
+Nodes are added and removed as roads are placed and destroyed, freed nodes are reused
 
-void _game::fireEvent(tileEvent e) {
-	//Send events here
-	bool loghere = (~e.flags & SILENT); //Silence is not specified
-	if (loghere) //We may call multiple times for a single operation
-		fprintf(logFile, "Firing events: [%i %i] pos: [%i %i] -> [%i %i]\n", e.events, e.flags, e.size.x, e.size.y, e.size.x + e.size.width, e.size.y + e.size.height);
+Routes use A* with ALT, the heuristic is the best triangle inequality bound over a few
+landmarks. Landmark distances are rebuilt lazily after the graph changes. Routes are
+cached per pair of nodes until the graph changes
+*/
+struct road_graph {
+	struct route {
+		int cost;
+		std::vector<int> tiles;
+	};
 
-	//To plop (single instance over many tiles)
-	if (e.plop_instance && !e.plop_instance->stale(e)) {
-		e.plop_instance->handle(e);
+	int width = 0, height = 0;
+	std::vector<int> nodeOf; //tile -> node, -1 when not a road
+	std::vector<int> tileOf; //node -> tile, -1 when free
+	std::vector<int> adjacency; //node * 4 + direction -> node, -1 when none
+	std::vector<int> freeNodes;
+	int nodes = 0;
+	int version = 0;
+
+	int landmarkVersion = -1;
+	std::vector<int> landmarks[ROAD_LANDMARKS]; //distance from each landmark per node
+
+	//Search state, stamped so nothing is cleared between searches
+	std::vector<int> cost, from, stamp;
+	int search = 0;
+
+	std::list<std::pair<uint64_t, route>> cache; //Most recent first
+	std::unordered_map<uint64_t, std::list<std::pair<uint64_t, route>>::iterator> cacheIndex;
+	int cacheVersion = -1;
+	unsigned long hits = 0, misses = 0, expanded = 0;
+
+	void reset(int width, int height) {
+		this->width = width;
+		this->height = height;
+		nodeOf.assign(width * height, -1);
+		tileOf.clear();
+		adjacency.clear();
+		freeNodes.clear();
+		nodes = 0;
+		version++;
+	}
+
+	int getNode(int x, int y) {
+		if (x < 0 || y < 0 || x >= width || y >= height)
+			return -1;
+		return nodeOf[y * width + x];
+	}
+
+	void addTile(int x, int y) {
+		if (x < 0 || y < 0 || x >= width || y >= height || nodeOf[y * width + x] != -1)
+			return;
+
+		int node;
+		if (freeNodes.size()) {
+			node = freeNodes.back();
+			freeNodes.pop_back();
+		} else {
+			node = tileOf.size();
+			tileOf.push_back(-1);
+			adjacency.insert(adjacency.end(), 4, -1);
+		}
+		tileOf[node] = y * width + x;
+		nodeOf[y * width + x] = node;
+		nodes++;
+
+		int neighbours[4] = { getNode(NORTH_F), getNode(EAST_F), getNode(SOUTH_F), getNode(WEST_F) };
+		for (int d = 0; d < 4; d++) {
+			adjacency[node * 4 + d] = neighbours[d];
+			if (neighbours[d] != -1)
+				adjacency[neighbours[d] * 4 + (d + 2) % 4] = node;
+		}
+		version++;
 	}
-	
-	if (e.parent && !e.parent->stale(e) && e.size.width == 1 && e.size.height == 1) {
-		e.parent->handle(e);
-		return;
+
+	void removeTile(int x, int y) {
+		int node = getNode(x, y);
+		if (node == -1)
+			return;
+		for (int d = 0; d < 4; d++) {
+			int other = adjacency[node * 4 + d];
+			if (other != -1)
+				adjacency[other * 4 + (d + 2) % 4] = -1;
+			adjacency[node * 4 + d] = -1;
+		}
+		nodeOf[tileOf[node]] = -1;
+		tileOf[node] = -1;
+		freeNodes.push_back(node);
+		nodes--;
+		version++;
+	}
+
+	void addArea(sizei area) {
+		for (int y = area.y; y < area.y + area.height; y++)
+			for (int x = area.x; x < area.x + area.width; x++)
+				addTile(x, y);
+	}
+
+	void removeArea(sizei area) {
+		for (int y = area.y; y < area.y + area.height; y++)
+			for (int x = area.x; x < area.x + area.width; x++)
+				removeTile(x, y);
+	}
+
+	//Unit weight distances from one node to every node, -1 when unreachable
+	void distances(int source, std::vector<int> &dist) {
+		dist.assign(tileOf.size(), -1);
+		std::vector<int> queue;
+		queue.reserve(nodes);
+		queue.push_back(source);
+		dist[source] = 0;
+		for (size_t i = 0; i < queue.size(); i++) {
+			int n = queue[i];
+			for (int d = 0; d < 4; d++) {
+				int m = adjacency[n * 4 + d];
+				if (m != -1 && dist[m] == -1) {
+					dist[m] = dist[n] + 1;
+					queue.push_back(m);
+				}
+			}
+		}
 	}
 
-	//To tile (many instances over many tiles)
-	for (tileComplete tc : getTiles(e.size)) {
-		if (tc.parent && !tc.parent->stale(tc))
-			//Duplicate flags and events and fire
-			tc.parent->handle(e.clone(tc),true);
+	//Farthest point landmarks, each one the node farthest from those already picked
+	void buildLandmarks() {
+		landmarkVersion = version;
+		int first = -1;
+		for (size_t n = 0; n < tileOf.size() && first == -1; n++)
+			if (tileOf[n] != -1)
+				first = n;
+		std::vector<int> nearest(tileOf.size(), INT_MAX);
+		int next = first;
+		for (int l = 0; l < ROAD_LANDMARKS; l++) {
+			if (next == -1) {
+				landmarks[l].assign(tileOf.size(), -1);
+				continue;
+			}
+			distances(next, landmarks[l]);
+			int best = -1;
+			for (size_t n = 0; n < tileOf.size(); n++) {
+				if (landmarks[l][n] != -1)
+					nearest[n] = std::min(nearest[n], landmarks[l][n]);
+				if (tileOf[n] != -1 && landmarks[l][n] != -1 && (best == -1 || nearest[n] > nearest[best]))
+					best = n;
+			}
+			next = best;
+		}
+	}
 
-		//Will fire multiple times for single instance!!!
-		if (tc.plop_instance)
-			tc.plop_instance->handle(e.clone(tc), false);
+	int heuristic(int n, int goal) {
+		int tn = tileOf[n], tg = tileOf[goal];
+		int h = abs(tn % width - tg % width) + abs(tn / width - tg / width);
+		for (int l = 0; l < ROAD_LANDMARKS; l++) {
+			int a = landmarks[l][n], b = landmarks[l][goal];
+			if (a != -1 && b != -1)
+				h = std::max(h, abs(a - b));
+		}
+		return h;
 	}
-}
 
-void _game::destroy(tileEvent e) {
-	//size could be a single plop or a group of tiles, or a group of plops
-	fireEvent(e.with(DESTROY));
+	//Cost from start to goal node, -1 when not connected, fills path with tile indices
+	int findPath(int start, int goal, std::vector<int> *path) {
+		if (landmarkVersion != version)
+			buildLandmarks();
+		if (cost.size() < tileOf.size()) {
+			cost.resize(tileOf.size());
+			from.resize(tileOf.size());
+			stamp.resize(tileOf.size(), 0);
+		}
+		search++;
+
+		typedef std::pair<int,int> entry; //estimate, node
+		std::priority_queue<entry, std::vector<entry>, std::greater<entry>> open;
+		cost[start] = 0;
+		from[start] = -1;
+		stamp[start] = search;
+		open.push({heuristic(start, goal), start});
+
+		while (open.size()) {
+			entry e = open.top();
+			open.pop();
+			int n = e.second;
+			if (e.first > cost[n] + heuristic(n, goal))
+				continue; //Stale entry
+			expanded++;
+			if (n == goal)
+				break;
+			for (int d = 0; d < 4; d++) {
+				int m = adjacency[n * 4 + d];
+				if (m == -1)
+					continue;
+				int c = cost[n] + 1;
+				if (stamp[m] == search && cost[m] <= c)
+					continue;
+				stamp[m] = search;
+				cost[m] = c;
+				from[m] = n;
+				open.push({c + heuristic(m, goal), m});
+			}
+		}
 
-	for (tileComplete tc : getTiles(e.size)) {
-		if (tc.parent != nullptr)
-			tc.parent->free();
-		if (tc.plop_instance != nullptr && registry.getInstance(tc.partial->getPlopId()) != nullptr) {
-			for (tileComplete p : tc.plop_instance->getTiles(tc))
-				tc.partial->setPlopId(0);
-			tc.plop_instance->free();
+		if (stamp[goal] != search)
+			return -1;
+		if (path) {
+			path->clear();
+			for (int n = goal; n != -1; n = from[n])
+				path->push_back(tileOf[n]);
+			std::reverse(path->begin(), path->end());
 		}
-		if (tc.partial != nullptr)
-			grass_tile.copyState(tc.partial);
-		else
-			*getPartial(tc.size) = grass_tile.getDefaultState();
+		return cost[goal];
 	}
-}
-
-void _game::destroy(sizei size) {
-	destroy(getEvent(size));
-}
 
-void _game::place(sizei size, tileBase *base) {
-	tileEvent e = getEvent(size);
-	e.parent = base;
-	place(e);
-}
+	/*
+	Road distance between two road tiles, -1 when either is not a road or they are not connected
+	The path holds tile indices from a to b
+	*/
+	int getRoute(posi a, posi b, std::vector<int> *path = nullptr) {
+		int start = getNode(a.x, a.y), goal = getNode(b.x, b.y);
+		if (start == -1 || goal == -1)
+			return -1;
+
+		if (cacheVersion != version) {
+			cache.clear();
+			cacheIndex.clear();
+			cacheVersion = version;
+		}
 
-void _game::place(tileEvent e) {
-	destroy(e);
+		uint64_t key = ((uint64_t)start << 32) | (uint32_t)goal;
+		auto it = cacheIndex.find(key);
+		if (it != cacheIndex.end()) {
+			hits++;
+			cache.splice(cache.begin(), cache, it->second);
+			if (path)
+				*path = it->second->second.tiles;
+			return it->second->second.cost;
+		}
 
-	e.plop_instance = nullptr;
+		misses++;
+		route r;
+		r.cost = findPath(start, goal, &r.tiles);
+		if (path)
+			*path = r.tiles;
+
+		cache.emplace_front(key, std::move(r));
+		cacheIndex[key] = cache.begin();
+		if (cache.size() > ROUTE_CACHE_SIZE) {
+			cacheIndex.erase(cache.back().first);
+			cache.pop_back();
+		}
+		return cache.front().second.cost;
+	}
+} roads;
 
-	//std::set<piece> pieces = tileSelection::getSelection(e.size);
-	//std::vector<tilePartial*> partials = getPartials(e.size);
-	std::set<piece> selection = tileSelection::fitSelection(e.size, e.parent);
+/*
+Road distance from every tile to the nearest job, from one multi source BFS over the road graph
+Road nodes next to a commercial or industrial plop are the sources
 
-	for (piece p : selection) {
-		tileBase *c = p.parent->clone();
-		//p.parent->setSize(e);
-		for (tilePartial *tp : getPartials(p.size)) {
-			c->setSize(p.with(tp, c->getPlop()));
-			p.parent->copyState(tp);
+New roads and jobs only shorten commutes, so they relax outward from the changed tiles.
+Removals drop every node whose time came through what was removed, then the nodes
+bordering the dropped ones relax back into them
+*/
+struct commute_field {
+	int width = 0, height = 0;
+	std::vector<unsigned char> jobs; //Job plops covering each tile
+	std::vector<unsigned short> nodeTime; //Per road node
+	std::vector<unsigned short> plane; //Per tile, through the closest road
+	std::vector<int> seeds; //Tiles that may have shortened
+	std::vector<std::pair<int,int>> cuts; //Node and the time of the road or job it lost
+	std::vector<std::pair<int,int>> dropped; //Node and the time it had
+	std::vector<int> stale; //Tiles to refresh after a removal
+	std::vector<int> queue;
+	bool rebuild = true;
+
+	void reset(int width, int height) {
+		this->width = width;
+		this->height = height;
+		jobs.assign(width * height, 0);
+		plane.assign(width * height, COMMUTE_NONE);
+		nodeTime.clear();
+		seeds.clear();
+		cuts.clear();
+		stale.clear();
+		rebuild = true;
+	}
+
+	bool inside(int x, int y) {
+		return x >= 0 && y >= 0 && x < width && y < height;
+	}
+
+	//Seed the area and the tiles around it
+	void seedArea(sizei area) {
+		for (int y = area.y - 1; y <= area.y + area.height; y++)
+			for (int x = area.x - 1; x <= area.x + area.width; x++)
+				if (inside(x, y))
+					seeds.push_back(y * width + x);
+	}
+
+	void addJobs(sizei area, int change) {
+		for (int y = area.y; y < area.y + area.height; y++)
+			for (int x = area.x; x < area.x + area.width; x++)
+				if (inside(x, y))
+					jobs[y * width + x] += change;
+		if (change > 0) {
+			seedArea(area);
+			return;
+		}
+		//Roads next to the area were sources at time 1
+		for (int y = area.y - 1; y <= area.y + area.height; y++) {
+			for (int x = area.x - 1; x <= area.x + area.width; x++) {
+				int node = roads.getNode(x, y);
+				if (node != -1)
+					cuts.push_back({node, 0});
+			}
 		}
 	}
 
-	fireEvent(e.with(PLACE));
-}
+	void addRoad(sizei area) {
+		seedArea(area);
+	}
+
+	//Call before the road graph drops the nodes, their neighbours may have been timed through them
+	void removeRoad(sizei area) {
+		for (int y = area.y; y < area.y + area.height; y++) {
+			for (int x = area.x; x < area.x + area.width; x++) {
+				int node = roads.getNode(x, y);
+				if (node == -1 || node >= (int)nodeTime.size())
+					continue;
+				for (int d = 0; d < 4; d++) {
+					int m = roads.adjacency[node * 4 + d];
+					if (m != -1)
+						cuts.push_back({m, nodeTime[node]});
+				}
+				nodeTime[node] = COMMUTE_NONE;
+			}
+		}
+		for (int y = area.y - 1; y <= area.y + area.height; y++)
+			for (int x = area.x - 1; x <= area.x + area.width; x++)
+				if (inside(x, y))
+					stale.push_back(y * width + x);
+	}
+
+	bool isSource(int tile) {
+		int x = tile % width, y = tile / width;
+		if (jobs[tile])
+			return true;
+		int around[8] = { NORTH_F, EAST_F, SOUTH_F, WEST_F };
+		for (int d = 0; d < 4; d++) {
+			int ax = around[d * 2], ay = around[d * 2 + 1];
+			if (inside(ax, ay) && jobs[ay * width + ax])
+				return true;
+		}
+		return false;
+	}
+
+	//Lower a node and queue it when it improves
+	void relax(int node, int time) {
+		if (time < nodeTime[node]) {
+			nodeTime[node] = time;
+			queue.push_back(node);
+		}
+	}
+
+	//Tile value, one step to the best road on or next to it
+	void updateTile(int x, int y) {
+		if (!inside(x, y))
+			return;
+		int nodes[5] = { roads.getNode(x,y), roads.getNode(NORTH_F), roads.getNode(EAST_F), roads.getNode(SOUTH_F), roads.getNode(WEST_F) };
+		int best = COMMUTE_NONE;
+		for (int n : nodes)
+			if (n != -1 && nodeTime[n] != COMMUTE_NONE)
+				best = std::min(best, nodeTime[n] + 1);
+		plane[y * width + x] = best;
+	}
+
+	//Drop a node timed one past from, unless it is a source
+	bool drop(int node, int from) {
+		if (node >= (int)nodeTime.size() || roads.tileOf[node] == -1 || nodeTime[node] == COMMUTE_NONE)
+			return false;
+		if (nodeTime[node] != from + 1 || isSource(roads.tileOf[node]))
+			return false;
+		dropped.push_back({node, nodeTime[node]});
+		nodeTime[node] = COMMUTE_NONE;
+		stale.push_back(roads.tileOf[node]);
+		return true;
+	}
+
+	//Drop everything timed through the cuts and queue the nodes around them that kept a time
+	void cut() {
+		for (std::pair<int,int> c : cuts)
+			drop(c.first, c.second);
+		cuts.clear();
+		for (size_t i = 0; i < dropped.size(); i++) {
+			int n = dropped[i].first, time = dropped[i].second;
+			for (int d = 0; d < 4; d++) {
+				int m = roads.adjacency[n * 4 + d];
+				if (m != -1 && !drop(m, time) && nodeTime[m] != COMMUTE_NONE)
+					queue.push_back(m);
+			}
+		}
+		dropped.clear();
+	}
+
+	void propagate() {
+		for (size_t i = 0; i < queue.size(); i++) {
+			int n = queue[i];
+			int tile = roads.tileOf[n];
+			int x = tile % width, y = tile / width;
+			for (int d = 0; d < 4; d++) {
+				int m = roads.adjacency[n * 4 + d];
+				if (m != -1)
+					relax(m, nodeTime[n] + 1);
+			}
+			updateTile(x, y);
+			updateTile(NORTH_F);
+			updateTile(EAST_F);
+			updateTile(SOUTH_F);
+			updateTile(WEST_F);
+		}
+		queue.clear();
+	}
+
+	void update() {
+		if (plane.empty())
+			return;
+		if (rebuild) {
+			nodeTime.assign(roads.tileOf.size(), COMMUTE_NONE);
+			std::fill(plane.begin(), plane.end(), COMMUTE_NONE);
+			for (size_t n = 0; n < roads.tileOf.size(); n++)
+				if (roads.tileOf[n] != -1 && isSource(roads.tileOf[n]))
+					relax(n, 1);
+			seeds.clear();
+			cuts.clear();
+			stale.clear();
+			rebuild = false;
+			propagate();
+			return;
+		}
+		if (seeds.empty() && cuts.empty() && stale.empty())
+			return;
+
+		nodeTime.resize(roads.tileOf.size(), COMMUTE_NONE);
+		cut();
+		for (int tile : seeds) {
+			int node = roads.nodeOf[tile];
+			if (node == -1)
+				continue;
+			if (isSource(tile))
+				relax(node, 1);
+			for (int d = 0; d < 4; d++) {
+				int m = roads.adjacency[node * 4 + d];
+				if (m != -1 && nodeTime[m] != COMMUTE_NONE)
+					relax(node, nodeTime[m] + 1);
+			}
+		}
+		seeds.clear();
+		propagate();
+
+		for (int tile : stale) {
+			int x = tile % width, y = tile / width;
+			updateTile(x, y);
+			updateTile(NORTH_F);
+			updateTile(EAST_F);
+			updateTile(SOUTH_F);
+			updateTile(WEST_F);
+		}
+		stale.clear();
+	}
+
+	//Shortest commute from any tile of the area
+	int get(sizei area) {
+		int best = COMMUTE_NONE;
+		for (int y = area.y; y < area.y + area.height; y++)
+			for (int x = area.x; x < area.x + area.width; x++)
+				if (inside(x, y))
+					best = std::min(best, (int)plane[y * width + x]);
+		return best;
+	}
+} commute;
+
+/*
+Road distance coverage per service type
+
+Each type runs one bounded multi source Dijkstra from the road nodes next to its buildings,
+with unit road weights. Coverage falls off linearly to zero at the type's radius and feeds
+the matching field as a source.
+
+A change can only move distances within one radius of it, so only that box is recomputed,
+seeded from the valid distances just outside it
+*/
+struct service_coverage {
+	const int field[SERVICE_COUNT] = { FIELD_HEALTH, FIELD_EDUCATION, FIELD_SAFETY };
+	const int radius[SERVICE_COUNT] = { 12, 16, 10 };
+
+	int width = 0, height = 0;
+	std::vector<unsigned char> buildings[SERVICE_COUNT]; //Service plops covering each tile
+	std::vector<unsigned short> dist[SERVICE_COUNT]; //Per road node
+	std::vector<float> plane[SERVICE_COUNT]; //Per tile, 0 to 1
+	sizei dirty[SERVICE_COUNT];
+	bool isDirty[SERVICE_COUNT] = {};
+	unsigned long recomputed = 0; //Nodes recomputed, for stats
+
+	//Zoned and reached tiles of a band of STATS_ROWS rows
+	struct band_counts {
+		int zoned = 0;
+		int reached[SERVICE_COUNT] = {};
+	};
+	std::vector<band_counts> bands;
+	std::vector<char> bandDirty; //Zoning or coverage changed in the band since the last publish
+
+	void reset(int width, int height) {
+		this->width = width;
+		this->height = height;
+		bands.assign((height + STATS_ROWS - 1) / STATS_ROWS, band_counts());
+		bandDirty.assign(bands.size(), 1);
+		for (int s = 0; s < SERVICE_COUNT; s++) {
+			buildings[s].assign(width * height, 0);
+			plane[s].assign(width * height, 0.0f);
+			dist[s].clear();
+			isDirty[s] = false;
+		}
+	}
+
+	bool inside(int x, int y) {
+		return x >= 0 && y >= 0 && x < width && y < height;
+	}
+
+	void markRows(int first, int last) {
+		for (int b = first / STATS_ROWS; b <= (last - 1) / STATS_ROWS; b++)
+			bandDirty[b] = 1;
+	}
+
+	//Grow the dirty box of a service by the area and its radius
+	void mark(int service, sizei area) {
+		int r = radius[service] + 1;
+		sizei box(area.x - r, area.y - r, area.width + r * 2, area.height + r * 2);
+		if (!isDirty[service]) {
+			dirty[service] = box;
+			isDirty[service] = true;
+			return;
+		}
+		sizei &d = dirty[service];
+		int x0 = std::min(d.x, box.x), y0 = std::min(d.y, box.y);
+		int x1 = std::max(d.x + d.width, box.x + box.width), y1 = std::max(d.y + d.height, box.y + box.height);
+		d = sizei(x0, y0, x1 - x0, y1 - y0);
+	}
+
+	void addBuilding(int service, sizei area, int change) {
+		for (int y = area.y; y < area.y + area.height; y++)
+			for (int x = area.x; x < area.x + area.width; x++)
+				if (inside(x, y))
+					buildings[service][y * width + x] += change;
+		mark(service, area);
+	}
+
+	void roadChanged(sizei area) {
+		for (int s = 0; s < SERVICE_COUNT; s++)
+			mark(s, area);
+	}
+
+	bool isSource(int service, int x, int y) {
+		int around[10] = { x, y, NORTH_F, EAST_F, SOUTH_F, WEST_F };
+		for (int d = 0; d < 5; d++) {
+			int ax = around[d * 2], ay = around[d * 2 + 1];
+			if (inside(ax, ay) && buildings[service][ay * width + ax])
+				return true;
+		}
+		return false;
+	}
+
+	//Move a tile's coverage and its field source with it
+	void setCoverage(int service, int x, int y) {
+		int nodes[5] = { roads.getNode(x,y), roads.getNode(NORTH_F), roads.getNode(EAST_F), roads.getNode(SOUTH_F), roads.getNode(WEST_F) };
+		int best = USHRT_MAX;
+		for (int n : nodes)
+			if (n != -1)
+				best = std::min(best, (int)dist[service][n]);
+		float value = best < radius[service] ? 1.0f - float(best + 1) / float(radius[service] + 1) : 0.0f;
+		float &old = plane[service][y * width + x];
+		fields.sources[field[service]][y * width + x] += (value - old) * SERVICE_EMIT;
+		if ((value > 0.0f) != (old > 0.0f))
+			bandDirty[y / STATS_ROWS] = 1;
+		old = value;
+	}
+
+	void recompute(int service) {
+		std::vector<unsigned short> &d = dist[service];
+		d.resize(roads.tileOf.size(), USHRT_MAX);
+		sizei box = dirty[service];
+		int x0 = std::max(box.x, 0), y0 = std::max(box.y, 0);
+		int x1 = std::min(box.x + box.width, width), y1 = std::min(box.y + box.height, height);
+		auto inBox = [&](int x, int y) { return x >= x0 && y >= y0 && x < x1 && y < y1; };
+
+		typedef std::pair<int,int> entry; //distance, node
+		std::priority_queue<entry, std::vector<entry>, std::greater<entry>> open;
+
+		for (int y = y0; y < y1; y++) {
+			for (int x = x0; x < x1; x++) {
+				int n = roads.getNode(x, y);
+				if (n == -1)
+					continue;
+				d[n] = USHRT_MAX;
+				if (isSource(service, x, y)) {
+					d[n] = 0;
+					open.push({0, n});
+				}
+			}
+		}
+
+		//Nodes just outside the box keep their distances and seed it
+		for (int y = y0 - 1; y <= y1; y++) {
+			for (int x = x0 - 1; x <= x1; x++) {
+				if (inBox(x, y))
+					continue;
+				int n = roads.getNode(x, y);
+				if (n != -1 && d[n] < radius[service])
+					open.push({d[n], n});
+			}
+		}
+
+		while (open.size()) {
+			entry e = open.top();
+			open.pop();
+			int n = e.second;
+			if (e.first > d[n] || e.first >= radius[service])
+				continue;
+			for (int dir = 0; dir < 4; dir++) {
+				int m = roads.adjacency[n * 4 + dir];
+				if (m == -1)
+					continue;
+				int tile = roads.tileOf[m];
+				if (!inBox(tile % width, tile / width) || d[m] <= e.first + 1)
+					continue;
+				d[m] = e.first + 1;
+				open.push({d[m], m});
+				recomputed++;
+			}
+		}
+
+		for (int y = std::max(y0 - 1, 0); y < std::min(y1 + 1, height); y++)
+			for (int x = std::max(x0 - 1, 0); x < std::min(x1 + 1, width); x++)
+				setCoverage(service, x, y);
+		isDirty[service] = false;
+	}
+
+	void update() {
+		for (int s = 0; s < SERVICE_COUNT; s++)
+			if (isDirty[s])
+				recompute(s);
+	}
+
+	float get(int service, int x, int y) {
+		return inside(x, y) ? plane[service][y * width + x] : 0.0f;
+	}
+
+	float covered[SERVICE_COUNT] = {}; //Share of zoned tiles each service reaches
+
+	//One pass over the tiles of the dirty bands counts the zoned tiles and what each service reaches
+	void publish() {
+		workers.run(bands.size(), [&](int b) {
+			if (!bandDirty[b])
+				return;
+			band_counts c;
+			for (int i = b * STATS_ROWS * width; i < std::min((b + 1) * STATS_ROWS, height) * width; i++) {
+				if (tileMap[i].getZone() == ZONING_NONE)
+					continue;
+				c.zoned++;
+				for (int s = 0; s < SERVICE_COUNT; s++)
+					c.reached[s] += plane[s][i] > 0.0f;
+			}
+			bands[b] = c;
+			bandDirty[b] = 0;
+		});
+		band_counts total;
+		for (band_counts &c : bands) {
+			total.zoned += c.zoned;
+			for (int s = 0; s < SERVICE_COUNT; s++)
+				total.reached[s] += c.reached[s];
+		}
+		for (int s = 0; s < SERVICE_COUNT; s++)
+			covered[s] = total.zoned ? float(total.reached[s]) / total.zoned : 0.0f;
+	}
+} coverage;
+
+/*
+Road access bit on the tiles of plops that need a road
+A plop has access while a road tile is within ROAD_REACH tiles of its footprint
+Only the plops around a changed road are looked at again
+*/
+struct road_access {
+	bool reaches(sizei area) {
+		for (int y = area.y - ROAD_REACH; y < area.y + area.height + ROAD_REACH; y++)
+			for (int x = area.x - ROAD_REACH; x < area.x + area.width + ROAD_REACH; x++)
+				if (roads.getNode(x, y) != -1)
+					return true;
+		return false;
+	}
+
+	void set(plop *pl, bool state) {
+		markRowsEdited(pl->size);
+		for (tilePartial *tp : game.getPartials(pl->size))
+			tp->setRoad(state);
+	}
+
+	void refresh(plop *pl) {
+		set(pl, pl->needsRoad() && reaches(pl->size));
+	}
+
+	//Call after the road graph has the change
+	void roadChanged(sizei area) {
+		std::set<plop*> seen;
+		int x0 = std::max(area.x - ROAD_REACH, 0), y0 = std::max(area.y - ROAD_REACH, 0);
+		int x1 = std::min(area.x + area.width + ROAD_REACH, tileMapWidth);
+		int y1 = std::min(area.y + area.height + ROAD_REACH, tileMapHeight);
+		for (int y = y0; y < y1; y++) {
+			for (int x = x0; x < x1; x++) {
+				tilePartial *tp = getPartial(x, y);
+				if (!tp->isPlop()) {
+					if (tp->getZone() != ZONING_NONE)
+						markLot(x, y);
+					continue;
+				}
+				plop *pl = (plop*)registry.getInstance(tp->getPlopId());
+				if (pl && pl->needsRoad() && seen.insert(pl).second)
+					refresh(pl);
+			}
+		}
+	}
+
+	bool has(plop *pl) {
+		return getPartial(pl->size.x, pl->size.y)->hasRoad();
+	}
+} roadAccess;
+
+/*
+Growth of zoned lots, a priority queue of lots scored from demand and the fields
+A few lots are popped each tick to build, upgrade or abandon. Lots are queued again
+only when something about them changes, so the cost follows the changes, not the map
+
+Lots that cannot develop yet wait per zone until the zone is in demand again
+*/
+struct development_scheduler {
+	struct lot {
+		float score;
+		int x, y;
+		unsigned int stamp;
+		bool operator<(const lot &b) const {
+			if (score != b.score)
+				return score < b.score;
+			return y > b.y || (y == b.y && x > b.x);
+		}
+	};
+
+	int width = 0, height = 0;
+	std::priority_queue<lot> queue;
+	std::vector<unsigned int> stamps; //Newest entry per tile, older entries are skipped
+	std::vector<int> waiting[4]; //Tiles per zone
+	std::vector<plop*> levels[4]; //Buildings per zone, smallest first
+	unsigned long built = 0, upgraded = 0, abandoned = 0;
+
+	void reset(int width, int height) {
+		this->width = width;
+		this->height = height;
+		queue = std::priority_queue<lot>();
+		stamps.assign(width * height, 0);
+		for (std::vector<int> &w : waiting)
+			w.clear();
+		levels[ZONING_RESIDENTIAL] = { &building1_plop, &building2_plop };
+		levels[ZONING_COMMERCIAL] = { &building4_plop, &tall_building_plop };
+		levels[ZONING_INDUSTRIAL] = { &building3_plop };
+		built = upgraded = abandoned = 0;
+	}
+
+	float desirability(int zone, int x, int y) {
+		switch (zone) {
+			case ZONING_RESIDENTIAL:
+				return fields.get(FIELD_LANDVALUE, x, y) + fields.get(FIELD_ENVIRONMENT, x, y) + fields.get(FIELD_SAFETY, x, y) - fields.get(FIELD_TRAFFIC, x, y);
+			case ZONING_COMMERCIAL:
+				return fields.get(FIELD_LANDVALUE, x, y) + fields.get(FIELD_TRAFFIC, x, y);
+			case ZONING_INDUSTRIAL:
+				return fields.get(FIELD_TRAFFIC, x, y) - fields.get(FIELD_LANDVALUE, x, y);
+		}
+		return 0.0f;
+	}
+
+	void mark(int x, int y) {
+		if (x < 0 || y < 0 || x >= width || y >= height)
+			return;
+		int zone = getPartial(x, y)->getZone();
+		if (zone == ZONING_NONE)
+			return;
+		float score = demandTotals.getDemand(zone, x, y) + 0.25f * desirability(zone, x, y);
+		queue.push({score, x, y, ++stamps[y * width + x]});
+	}
+
+	//Every tile is zoned the same and empty or part of current
+	bool fits(sizei area, int zone, plop *current) {
+		if (area.x < 0 || area.y < 0 || area.x + area.width > width || area.y + area.height > height)
+			return false;
+		for (tilePartial *tp : game.getPartials(area)) {
+			if (tp->getZone() != zone)
+				return false;
+			if (tp->isPlop() && registry.getInstance(tp->getPlopId()) != current)
+				return false;
+		}
+		return true;
+	}
+
+	//Placing and destroying unzones the tiles, put the zone back
+	void rezone(sizei area, int zone) {
+		markRowsEdited(area);
+		for (tilePartial *tp : game.getPartials(area))
+			zoneTiles[zone]->copyState(tp);
+	}
+
+	void build(sizei area, int zone, plop *base) {
+		tileEvent e = getEvent(area);
+		e.parent = base;
+		game.place(e.with(0, SILENT));
+		rezone(area, zone);
+	}
+
+	void develop(lot l) {
+		tilePartial *tp = getPartial(l.x, l.y);
+		int zone = tp->getZone();
+		if (zone == ZONING_NONE)
+			return;
+		float demand = demandTotals.getDemand(zone, l.x, l.y);
+		std::vector<plop*> &level = levels[zone];
+
+		if (!tp->isPlop()) {
+			if (demand < DEVELOP_FILL || !roadAccess.reaches({l.x, l.y, 1, 1})) {
+				waiting[zone].push_back(l.y * width + l.x);
+				return;
+			}
+			for (plop *base : level) {
+				sizei area(l.x, l.y, base->size.width, base->size.height);
+				if (fits(area, zone, nullptr)) {
+					build(area, zone, base);
+					built++;
+					return;
+				}
+			}
+			return;
+		}
+
+		plop *p = (plop*)registry.getInstance(tp->getPlopId());
+		if (!p || p->zone != zone || p->size.x != l.x || p->size.y != l.y)
+			return;
+
+		int levelCount = level.size();
+		int current = 0;
+		while (current < levelCount && level[current]->initial_id != p->initial_id)
+			current++;
+
+		if (p->population == p->capacity && demand >= DEVELOP_FILL && current + 1 < levelCount) {
+			plop *next = level[current + 1];
+			sizei area(l.x, l.y, next->size.width, next->size.height);
+			if (fits(area, zone, p)) {
+				build(area, zone, next);
+				upgraded++;
+			}
+		} else if (p->population == 0 && demand < DEVELOP_ABANDON) {
+			sizei area = p->size;
+			game.destroy(getEvent(area).with(0, SILENT));
+			rezone(area, zone);
+			abandoned++;
+			waiting[zone].push_back(l.y * width + l.x);
+		}
+	}
+
+	void update() {
+		for (int zone = ZONING_RESIDENTIAL; zone <= ZONING_INDUSTRIAL; zone++) {
+			if (demandTotals.getDemand(zone) < DEVELOP_FILL)
+				continue;
+			for (int i = 0; i < DEVELOP_BUDGET && waiting[zone].size(); i++) {
+				int t = waiting[zone].back();
+				waiting[zone].pop_back();
+				mark(t % width, t / width);
+			}
+		}
+
+		int budget = DEVELOP_BUDGET;
+		while (budget > 0 && queue.size()) {
+			lot l = queue.top();
+			queue.pop();
+			if (l.stamp != stamps[l.y * width + l.x])
+				continue;
+			develop(l);
+			budget--;
+		}
+	}
+} development;
+
+void markLot(int x, int y) {
+	development.mark(x, y);
+}
+
+bool isJob(plop *pl) {
+	return pl->zone == ZONING_COMMERCIAL || pl->zone == ZONING_INDUSTRIAL;
+}
+
+//Tell the incremental systems a plop arrived
+void addPlopEffects(plop *pl) {
+	float emit[FIELD_COUNT];
+	pl->getEmission(&emit[0]);
+	fields.addSource(pl->size, &emit[0], 1.0f);
+	if (pl->typeId == TRAFFIC_ROAD) {
+		roads.addArea(pl->size);
+		commute.addRoad(pl->size);
+		coverage.roadChanged(pl->size);
+		roadAccess.roadChanged(pl->size);
+	}
+	roadAccess.refresh(pl);
+	if (isJob(pl))
+		commute.addJobs(pl->size, 1);
+	if (pl->getService() != -1)
+		coverage.addBuilding(pl->getService(), pl->size, 1);
+	demandTotals.add(pl->zone, pl->size.x, pl->size.y, pl->capacity, pl->population);
+}
+
+//Tell the incremental systems a plop is leaving
+void removePlopEffects(plop *pl) {
+	float emit[FIELD_COUNT];
+	pl->getEmission(&emit[0]);
+	fields.addSource(pl->size, &emit[0], -1.0f);
+	if (pl->typeId == TRAFFIC_ROAD) {
+		commute.removeRoad(pl->size);
+		roads.removeArea(pl->size);
+		coverage.roadChanged(pl->size);
+		roadAccess.roadChanged(pl->size);
+	}
+	roadAccess.set(pl, false);
+	if (isJob(pl))
+		commute.addJobs(pl->size, -1);
+	if (pl->getService() != -1)
+		coverage.addBuilding(pl->getService(), pl->size, -1);
+	demandTotals.remove(pl->zone, pl->size.x, pl->size.y, pl->capacity, pl->population);
+}
+
+/*
+Simulation values read by the overlays
+*/
+struct overlay_values {
+	float waterSupply, waterDemand;
+	int waterNetworks;
+	int commercialJobs, commercialPopulation;
+	float commercialDemand;
+	int industrialJobs, industrialPopulation;
+	float industrialDemand;
+	int residentialCapacity, population;
+	float residentialDemand;
+	float environment, health, safety, traffic, education, landvalue;
+	int day, month;
+	float speed;
+	network_stats water;
+	int roadNodes;
+	unsigned long routeHits, routeMisses;
+	int lodChunks;
+	int snapshotRows; //Rows the last publish copied
+	int lotsQueued;
+	unsigned long lotsBuilt;
+	plane_stats fieldStats[FIELD_COUNT];
+	float covered[SERVICE_COUNT];
+};
+
+/*
+Copy of the tile planes and overlay values published by the simulation thread
+
+One snapshot is being written by the simulation, one is ready, and one is
+being rendered, so neither thread waits on the other for a whole frame
+*/
+struct world_snapshot {
+	std::vector<tilePartial> tiles;
+	std::vector<unsigned long> rowEdits; //tileRowEdits of each row when it was copied
+	sizei mapSize;
+	overlay_values values;
+	unsigned long tick = 0;
+};
+
+world_snapshot snapshots[3];
+world_snapshot *writeSnapshot = &snapshots[0];
+world_snapshot *readySnapshot = &snapshots[1];
+world_snapshot *renderSnapshot = &snapshots[2];
+bool snapshotFresh = false;
+std::mutex snapshotMutex;
+
+//Snapshot the current thread reads tiles from, nullptr for the live map
+thread_local world_snapshot *viewSnapshot = nullptr;
+
+/*
+Held shared while reading instances, network values or tiles,
+and exclusive while changing any of them, the simulation tick takes it exclusively
+*/
+std::shared_mutex worldMutex;
+
+#pragma endregion
+
+#pragma region //Function implementations that are forward declared
+
+template<template<typename> typename POS, typename T1, typename FUNCTION>
+void util::areaLoop(POS<T1> size, FUNCTION func) {
+	for (int x = size.x; x < size.x + size.width; x++) {
+		for (int y = size.y; y < size.y + size.height; y++) {
+			POS<T1> target(x,y);
+			func(target);
+		}
+	}
+}
+
+template<template<typename> typename POS, typename T1, typename T2,typename FUNCTION>
+void util::radiusLoop(POS<T1> p, T2 radius, FUNCTION func) {
+	for (T1 x = p.x - radius; x < p.x + radius; x++) {
+		for (T1 y = p.y - radius; y < p.y + radius; y++) {
+			POS<T1> target(x,y);
+			if (p.distsq(target) < radius * radius)
+				func(target);
+		}
+	}
+}
+
+bool _game::isInRadius(int ox, int oy, int px, int py, float r) {
+	return isInRadius({ox,oy,px,py}, r);
+}
+
+bool _game::isInRadius(sizei size, float r) {
+	return size.distsq() < r * r;
+}
+
+bool _game::isInBounds(posi p) {
+	return isInBounds(p.with(1,1));
+}
+
+bool _game::isInBounds(sizei p) {
+	return getMapSize().contains(p);
+}
+
+template<typename FUNCTION, typename Tradius>
+void _game::tileRadiusLoop(posi p, Tradius radius, FUNCTION func) {
+	util::radiusLoop(p, radius, [&](posi target) {
+		if (isInBounds(target))
+			func(target);
+	});
+}
+
+template<typename FUNCTION, typename Tradius>
+void _game::tileRadiusLoop(int x, int y, Tradius radius, FUNCTION func) {
+	tileRadiusLoop(posi(x,y), radius, func);
+}
+
+template<typename FUNCTION>
+void _game::tileAreaLoop(sizei size, FUNCTION func) {
+	util::areaLoop(size, [&](posi p) {
+		if (isInBounds(p))
+			func(p);
+	});
+}
+
+std::vector<tileComplete> _game::getTiles(sizei size) {
+	std::vector<tileComplete> tiles;
+
+	if (size.width == 1 && size.height == 1) {
+		tiles.push_back(getComplete(size));
+		return tiles;
+	}
+
+	for (int x = size.x; x < size.x + size.width; x++) {
+		for (int y = size.y; y < size.y + size.height; y++) {
+			tiles.push_back(getComplete(x,y));
+		}
+	}
+
+	return tiles;
+}
+
+std::vector<tilePartial*> _game::getPartials(sizei size) {
+	std::vector<tilePartial*> tiles;
+
+	if (size.width == 1 && size.height == 1) {
+		tiles.push_back(getPartial(size));
+		return tiles;
+	}
+
+	for (int x = size.x; x < size.x + size.width; x++) {
+		for (int y = size.y; y < size.y + size.height; y++) {
+			tiles.push_back(getPartial(x,y));
+		}
+	}
+
+	return tiles;
+}
+
+void _game::fireEvent(sizei size, int events) {
+	fireEvent(getEvent(size), events);
+}
+
+void _game::fireEvent(tileEvent e, int events) {
+	fireEvent(e.with(events));
+}
+
+void _game::fireEvent(sizei size, int events, int flags) {
+	fireEvent(getEvent(size).with(events,flags));
+}
+
+void _game::fireEvent(tileEvent e) {
+	//Send events here
+	bool loghere = (~e.flags & SILENT); //Silence is not specified
+	if (loghere) //We may call multiple times for a single operation
+		fprintf(logFile, "Firing events: [%i %i] pos: [%i %i] -> [%i %i]\n", e.events, e.flags, e.size.x, e.size.y, e.size.x + e.size.width, e.size.y + e.size.height);
+
+	//To plop (single instance over many tiles)
+	if (e.plop_instance && !e.plop_instance->stale(e)) {
+		e.plop_instance->handle(e);
+	}
+	
+	if (e.parent && !e.parent->stale(e) && e.size.width == 1 && e.size.height == 1) {
+		e.parent->handle(e);
+		return;
+	}
+
+	//To tile (many instances over many tiles)
+	for (tileComplete tc : getTiles(e.size)) {
+		if (tc.parent && !tc.parent->stale(tc))
+			//Duplicate flags and events and fire
+			tc.parent->handle(e.clone(tc),true);
+
+		//Will fire multiple times for single instance!!!
+		if (tc.plop_instance)
+			tc.plop_instance->handle(e.clone(tc), false);
+	}
+}
+
+void _game::destroy(tileEvent e) {
+	//size could be a single plop or a group of tiles, or a group of plops
+	markRowsEdited(e.size);
+	fireEvent(e.with(DESTROY));
+
+	for (tileComplete tc : getTiles(e.size)) {
+		if (tc.parent != nullptr)
+			tc.parent->free();
+		if (tc.plop_instance != nullptr && registry.getInstance(tc.partial->getPlopId()) != nullptr) {
+			removePlopEffects(tc.plop_instance);
+			for (tileComplete p : tc.plop_instance->getTiles(tc))
+				tc.partial->setPlopId(0);
+			tc.plop_instance->free();
+		}
+		if (tc.partial != nullptr) {
+			grass_tile.copyState(tc.partial);
+			tc.partial->setZone(ZONING_NONE);
+		} else
+			*getPartial(tc.size) = grass_tile.getDefaultState();
+	}
+}
+
+void _game::destroy(sizei size) {
+	destroy(getEvent(size));
+}
+
+void _game::place(sizei size, tileBase *base) {
+	tileEvent e = getEvent(size);
+	e.parent = base;
+	place(e);
+}
+
+void _game::place(tileEvent e) {
+	destroy(e);
+
+	e.plop_instance = nullptr;
+
+	//std::set<piece> pieces = tileSelection::getSelection(e.size);
+	//std::vector<tilePartial*> partials = getPartials(e.size);
+	std::set<piece> selection = tileSelection::fitSelection(e.size, e.parent);
+
+	for (piece p : selection) {
+		tileBase *c = p.parent->clone();
+		//p.parent->setSize(e);
+		markRowsEdited(p.size);
+		for (tilePartial *tp : getPartials(p.size)) {
+			c->setSize(p.with(tp, c->getPlop()));
+			//Tiles take the clone's id, not the sizeless instance passed in
+			c->copyState(tp);
+		}
+		if (plop *pl = c->getPlop())
+			addPlopEffects(pl);
+	}
+
+	fireEvent(e.with(PLACE));
+}
 
 tileBase *instance_registry::addInstance(tileBase *t) {
 	if (getInstance(t->id) != nullptr && t->id != 0) {
 		fprintf(logFile, "Instance already exists: %i\n", t->id);
 		return t;
 	}
-	t->id = nextId();
-	instances.push_back(t);
-	return t;
+	t->id = nextId();
+	instances.push_back(t);
+	return t;
+}
+
+tileBase *instance_registry::getInstance(int id) {
+	for (auto _t : instances) {
+		if (_t->id == id)
+			return _t;
+	}
+	return nullptr;
+}
+
+tileBase *instance_registry::addPlaceable(tileBase *t) {
+	placeable.push_back(t);
+	return t;
+}
+
+tileBase *instance_registry::getPlaceable(int id) {
+	return placeable[id];
+}
+
+void _game::init(sizei mapsize, unsigned int seed) {
+	srand(seed);
+	
+	waterSupply = 0;
+	waterDemand = 0;
+	waterNetworks = 0;
+	
+	day = 1;
+	month = 1;
+	
+	init_plops();
+
+	if (tileMap)
+		delete [] tileMap;
+	
+	mapSize = mapsize;
+	tileMapWidth = mapSize.width;
+	tileMapHeight = mapSize.height;
+	tileMap = new tilePartial[tileMapWidth * tileMapHeight];
+	tileRowEdits.assign(tileMapHeight, tileEpoch);
+	tilesTouched = true;
+	demandTotals.reset(tileMapWidth, tileMapHeight);
+	lod.reset(tileMapWidth, tileMapHeight);
+	fields.reset(tileMapWidth, tileMapHeight);
+	roads.reset(tileMapWidth, tileMapHeight);
+	commute.reset(tileMapWidth, tileMapHeight);
+	coverage.reset(tileMapWidth, tileMapHeight);
+	development.reset(tileMapWidth, tileMapHeight);
+
+	for (int y = 0; y < tileMapHeight; y++) {
+		for (int x = 0; x < tileMapWidth; x++) {
+			tileEvent e(tileComplete(grass_tile.clone(), &partially_garbage, {x,y,1,1}));
+			game.place(e.with(0, SILENT));
+			if (rand() % 2 == 0);
+			if (rand() % 4 == 0);
+		}
+	}
+
+	game.place({0,0,tileMapWidth,tileMapHeight}, grass_tile.clone());
+	fprintf(logFile, "grass_tile %p\n", grass_tile.clone());
+	game.place({2,2,1,1}, water_tower_plop.clone());
+	game.place({3,2,1,1}, water_tower_plop.clone());
+	game.place({4,2,1,1}, water_tower_plop.clone());
+	game.place({5,2,1,1}, water_tower_plop.clone());
+	game.place({2,4,2,2}, building3_plop.clone());
+	game.place({4,4,2,1}, building2_plop.clone());
+	//Road past the demo buildings so they have a commute
+	game.place({2,3,10,1}, road_plop.clone());
+	game.place({8,2,4,1}, residential_zone_tile.clone());
+	game.place({6,4,2,2}, commercial_zone_tile.clone());
+}
+
+tilePartial *getPartial(int x, int y) {
+	if (viewSnapshot) {
+		sizei map = viewSnapshot->mapSize;
+		if (x >= map.width || x < 0 || y >= map.height || y < 0) {
+			static thread_local tilePartial outside;
+			return &(outside = tilePartial());
+		}
+		return &viewSnapshot->tiles[y * map.width + x];
+	}
+	if (x >= tileMapWidth || x < 0 || y >= tileMapHeight || y < 0) {
+		fprintf(logFile, "Out of bounds: %i %i\n", x, y);
+		return &(partially_garbage = tilePartial());//&tiles::DEFAULT_TILE->defaultState;
+	}
+	return &tileMap[y * tileMapWidth + x];
+}
+
+/*
+Writers mark the rows they change so the next snapshot copies them
+Reads through getPartial leave the rows alone
+*/
+void markRowsEdited(sizei area) {
+	int y0 = std::max(area.y, 0), y1 = std::min(area.y + area.height, tileMapHeight);
+	for (int y = y0; y < y1; y++)
+		tileRowEdits[y] = tileEpoch;
+	if (y0 < y1) {
+		tilesTouched = true;
+		coverage.markRows(y0, y1);
+	}
+}
+
+tilePartial *getPartial(posi p) {
+	return getPartial(p.x,p.y);
+}
+
+tileComplete getComplete(int x, int y) {
+	tileComplete tc(nullptr, nullptr, {x,y,1,1});
+	tc.partial = getPartial(x,y);
+	tc.parent = registry.getInstance(tc.partial->id);
+	tc.plop_instance = nullptr;
+	if (tc.partial->isPlop())
+		tc.plop_instance = (plop*)registry.getInstance(tc.partial->getPlopId());
+	return tc;
+}
+
+tileComplete getComplete(posi p) {
+	return getComplete(p.x,p.y);
+}
+
+tileEvent getEvent(sizei p) {
+	tileEvent e = getComplete(p);
+	e.size = p;
+	return e;
+}
+
+#pragma endregion
+
+#pragma region //Display functions
+
+dirty_region tileReach;
+
+//Tiles that can reach the screen, the pad covers the render area around a tile
+tile_range visibleTiles() {
+	sizei screen = mainTarget->getSize();
+	float width = getWidth();
+	float height = getHeight();
+	return tile_range(screen.x / width, screen.y / height, screen.width / width, screen.height / height, 3.0f);
+}
+
+/*
+What the screen was last drawn with, any change draws all of it again
+*/
+struct view_state {
+	float viewX, viewY, scale;
+	bool waterView, plopsOnly, placementMode;
+	sizei screen;
+
+	bool operator==(const view_state &b) const {
+		return viewX == b.viewX && viewY == b.viewY && scale == b.scale &&
+			waterView == b.waterView && plopsOnly == b.plopsOnly && placementMode == b.placementMode &&
+			screen == b.screen;
+	}
+} drawnView;
+
+/*
+Ground of each chunk drawn once into an off-screen buffer, frames composite the buffers
+A buffer is kept while its tiles and their neighbours are unchanged and the view still places
+every tile at the same offset inside it, the offsets shift with rounding as the view moves
+*/
+struct terrain_cache {
+	struct chunk {
+		std::vector<tilePartial> tiles; //Chunk and a one tile border when drawn
+		uint64_t signature = 0; //Tile offsets when drawn
+		sizei box; //Screen area when drawn
+	};
+
+	std::vector<chunk> chunks;
+	int chunksX = 0, chunksY = 0;
+	sizei map;
+	view_state view;
+	retained_cache buffers;
+	image layer; //Key for the buffers, the state is the chunk
+	unsigned long builds = 0, reused = 0;
+
+	terrain_cache() {
+		buffers.budget = TERRAIN_BUDGET;
+	}
+
+	void resize(sizei map) {
+		this->map = map;
+		chunksX = (map.width + TERRAIN_CHUNK - 1) / TERRAIN_CHUNK;
+		chunksY = (map.height + TERRAIN_CHUNK - 1) / TERRAIN_CHUNK;
+		chunks.assign(chunksX * chunksY, chunk());
+	}
+
+	sizei tiles(int cx, int cy) {
+		int x = cx * TERRAIN_CHUNK, y = cy * TERRAIN_CHUNK;
+		return {x, y, std::min(TERRAIN_CHUNK, map.width - x), std::min(TERRAIN_CHUNK, map.height - y)};
+	}
+
+	//Characters a ground sprite covers, rows go up from the render area
+	static sizei cover(int x, int y) {
+		sizei area = tileBase::getRenderArea({x,y,1,1});
+		return {area.x, area.y - area.height + 1, area.width, area.height};
+	}
+
+	//Offsets follow the map axes, the corners bound the chunk
+	sizei box(sizei t) {
+		int x0 = INT_MAX, y0 = INT_MAX, x1 = INT_MIN, y1 = INT_MIN;
+		posi corners[4] = { t.start(), {t.x + t.width - 1, t.y}, {t.x, t.y + t.height - 1}, {t.x + t.width - 1, t.y + t.height - 1} };
+		for (posi &p : corners) {
+			sizei c = cover(p.x, p.y);
+			x0 = std::min(x0, c.x);
+			y0 = std::min(y0, c.y);
+			x1 = std::max(x1, c.x + c.width);
+			y1 = std::max(y1, c.y + c.height);
+		}
+		return {x0, y0, x1 - x0, y1 - y0};
+	}
+
+	//Same math as getRenderArea, offsets from the first tile stand for offsets in the box
+	uint64_t sign(sizei t, sizei box) {
+		float width = getWidth();
+		float height = getHeight();
+		int x0 = getOffsetX(t.x, t.y) * width;
+		int y0 = getOffsetY(t.x - 1, t.y + 1) * height;
+		uint64_t h = 14695981039346656037ull;
+		h = (h ^ (uint32_t)box.width) * 1099511628211ull;
+		h = (h ^ (uint32_t)box.height) * 1099511628211ull;
+		for (int y = t.y; y < t.y + t.height; y++) {
+			for (int x = t.x; x < t.x + t.width; x++) {
+				int cx = getOffsetX(x, y) * width;
+				int cy = getOffsetY(x - 1, y + 1) * height;
+				h = (h ^ (uint32_t)(cx - x0)) * 1099511628211ull;
+				h = (h ^ (uint32_t)(cy - y0)) * 1099511628211ull;
+			}
+		}
+		return h;
+	}
+
+	void copyTiles(sizei t, std::vector<tilePartial> &out) {
+		out.clear();
+		for (int y = t.y - 1; y <= t.y + t.height; y++)
+			for (int x = t.x - 1; x <= t.x + t.width; x++)
+				out.push_back(*getPartial(x, y));
+	}
+
+	bool sameTiles(sizei t, std::vector<tilePartial> &drawn) {
+		if (drawn.empty())
+			return false;
+		tilePartial *d = &drawn[0];
+		for (int y = t.y - 1; y <= t.y + t.height; y++) {
+			for (int x = t.x - 1; x <= t.x + t.width; x++, d++) {
+				tilePartial *now = getPartial(x, y);
+				if (d->id != now->id || d->data.b != now->data.b)
+					return false;
+			}
+		}
+		return true;
+	}
+
+	void build(chunk &c, sizei t, retained_target *buffer) {
+		draw_target *target = mainTarget;
+		posi origin = renderOrigin;
+		mainTarget = buffer;
+		renderOrigin = c.box.start();
+		buffer->clear();
+		buffer->stale = true;
+		for (int y = t.y; y < t.y + t.height; y++) {
+			for (int x = t.x; x < t.x + t.width; x++) {
+				tileComplete tc = getComplete(x, y);
+				if (tc.parent)
+					tc.parent->render(tileEvent(tc));
+			}
+		}
+		buffer->stale = false;
+		renderOrigin = origin;
+		mainTarget = target;
+		copyTiles(t, c.tiles);
+		builds++;
+	}
+
+	//Composite the ground of every chunk in the tile range
+	void draw(buffer_target *bt, tile_range range) {
+		sizei size = game.getMapSize();
+		if (!(size == map))
+			resize(size);
+
+		view_state now = { viewX, viewY, scale, waterView, plopsOnly, placementMode, bt->getSize() };
+		bool moved = !(now == view);
+		view = now;
+
+		sizei screen = bt->getSize();
+		int firstColumn = std::max(range.firstColumn(), 0);
+		int lastColumn = std::min(range.lastColumn(), map.width - 1);
+		int firstRow = INT_MAX, lastRow = INT_MIN;
+		for (int x = firstColumn; x <= lastColumn; x++) {
+			firstRow = std::min(firstRow, std::max(range.firstRow(x), 0));
+			lastRow = std::max(lastRow, std::min(range.lastRow(x), map.height - 1));
+		}
+
+		for (int cy = firstRow / TERRAIN_CHUNK; cy <= lastRow / TERRAIN_CHUNK && lastRow >= 0; cy++) {
+			for (int cx = firstColumn / TERRAIN_CHUNK; cx <= lastColumn / TERRAIN_CHUNK && lastColumn >= 0; cx++) {
+				chunk &c = chunks[cy * chunksX + cx];
+				sizei t = tiles(cx, cy);
+				sizei b = box(t);
+				if (b.x >= screen.x + screen.width || b.x + b.width <= screen.x ||
+					b.y >= screen.y + screen.height || b.y + b.height <= screen.y)
+					continue;
+
+				bool fits = b.width == c.box.width && b.height == c.box.height;
+				if (fits && moved)
+					fits = sign(t, b) == c.signature;
+				retained_target *buffer = buffers.get(&layer, {0, 0, b.width, b.height}, cy * chunksX + cx);
+				c.box = b;
+				if (buffer->shouldUpdate() || !fits || !sameTiles(t, c.tiles)) {
+					c.signature = sign(t, b);
+					build(c, t, buffer);
+				} else {
+					reused++;
+				}
+				bt->draw(buffer, b.start());
+			}
+		}
+	}
+} terrain;
+
+void displayTileMap() {
+	float width = getWidth();
+	float height = getHeight();
+
+	sizei screen = mainTarget->getSize();
+	sizei map = game.getMapSize();
+
+	tileComplete tc;
+	tileEvent e;
+
+	//Retained frames only draw the tiles whose sprites can reach a dirty cell
+	buffer_target *bt = mainTarget->is_retained_mode() ? (buffer_target*)mainTarget : nullptr;
+	if (bt) {
+		if (!screenDirty.any)
+			return;
+		int padX = (DIRTY_PAD_TILES + 1) * width / DIRTY_CELL_WIDTH + 1;
+		int padY = (DIRTY_PAD_TILES + 1) * height / DIRTY_CELL_HEIGHT + 1;
+		screenDirty.grow(tileReach, padX, padY);
+	}
+
+	tile_range range = visibleTiles();
+	int lastColumn = std::min(range.lastColumn(), map.width - 1);
+	int firstColumn = std::max(range.firstColumn(), 0);
+
+	//The ground comes from the chunk layers, the tiles below only add plops
+	bool layered = bt && !waterView && !plopsOnly;
+	if (layered)
+		terrain.draw(bt, range);
+
+	for (int x = lastColumn; x >= firstColumn; x--) {
+		int lastRow = std::min(range.lastRow(x), map.height - 1);
+		for (int y = std::max(range.firstRow(x), 0); y <= lastRow; y++) {
+			//Ground is in the layers, only plops are left
+			if (layered && !getPartial(x,y)->isPlop())
+				continue;
+
+			sizei renderArea = tileBase::getRenderArea({x,y,1,1});
+			//renderArea.height = renderArea.height - renderArea.y;
+			renderArea.y -= getHeight();
+
+			if (!screen.overlaps(renderArea))
+				continue;
+			if (bt && !tileReach.test(renderArea.start()))
+				continue;
+			
+			tc = getComplete(x,y);
+			e = tileEvent(tc);
+			tilePartial *partial = tc.partial;
+
+			if (waterView) {
+				dirt_tile.render(e);
+				if (partial->hasUnderground(UNDERGROUND_WATER_PIPE))
+					water_pipe_tile.render(e);
+			} else {
+				if (tc.parent && !plopsOnly && !layered)
+					tc.parent->render(e);
+				if (tc.plop_instance) {
+					tc.plop_instance->render(e);
+				}
+			}
+		}
+	}
+}
+
+void displayXY() {
+	posf p = {getScreenOffsetX(0.2,0),getScreenOffsetY(0.5,0)};
+	//posf _x = {1,0}, _y = {0,1};
+	posf x = getOffsetXY({4,0}).add(-viewX, -viewY);
+	posf y = getOffsetXY({0,4}).add(-viewX, -viewY);
+	x.x *= getCharacterYoverX();
+	y.x *= getCharacterYoverX();
+
+	adv::line(p.x,p.y,p.x + x.x,p.y + x.y,'X',FRED|BBLACK);
+	adv::line(p.x,p.y,p.x + y.x,p.y + y.y,'Y',FGREEN|BBLACK);
+
+	float x0 = std::min(0.0f, std::min(x.x, y.x)), x1 = std::max(0.0f, std::max(x.x, y.x));
+	float y0 = std::min(0.0f, std::min(x.y, y.y)), y1 = std::max(0.0f, std::max(x.y, y.y));
+	screenDirty.mark({int(p.x + x0) - 1, int(p.y + y0) - 1, int(x1 - x0) + 3, int(y1 - y0) + 3});
+}
+
+void centerDisplay() {
+	sizei selected = tileSelector.selected.size;
+	posi selectedCenter = selected.center(); //tilespace
+	int area = selected.area();
+	viewX = 0;
+	viewY = 0;
+	posf map = {(float)-selectedCenter.x, (float)-selectedCenter.y}; //tilespace
+	posf selectedOffset = getOffsetXY(map); //screenspace before scaling
+	posf off = {(scale / 4 * getCharacterYoverX()), scale / 4}; //screenspace
+
+			//tilespace        tilespace
+	off.x = selectedCenter.x - (selected.x / scale * 2);
+	off.y = selectedCenter.y - (selected.y / scale);
+
+	off.x = 2; //tilespace
+	off.y = 5;
+
+	//viewX and viewY are in screenspace, before scaling
+
+	viewX = selectedOffset.x + getOffsetX(off);
+	viewY = selectedOffset.y + getOffsetY(off);
+
+	//posf tileOffset = {40,20};
+	posf tileOffset = {adv::width / 4.0f, adv::height / 2.0f};
+	
+	//I don't know how this works
+
+	viewX = selectedOffset.x + (tileOffset.x / scale); //5
+	viewY = selectedOffset.y + (tileOffset.y / scale); //2
+}
+
+void displayEdges() {
+	//Edges of the map
+	float corners[] = {
+		0.5f,-0.5f,
+		tileMapWidth+0.5f,-0.5f,
+		tileMapWidth+0.5f,tileMapHeight-0.5f,
+		0.5f,tileMapHeight-0.5f,
+		0.5f,-0.5f,
+	};
+	for (int i = 0; i < 8; i+=2) {
+		//break;
+		//int next = (i + 2) % 8;
+		int next = i + 2;
+		int width = getWidth();
+		int height = getHeight();
+		float offsetx1 = getOffsetX(corners[i + 1], corners[i]);// - (xfact / 2.0f);
+		float offsety1 = getOffsetY(corners[i + 1], corners[i]);// + (yfact / 2.0f);
+		float offsetx2 = getOffsetX(corners[next + 1], corners[next]);// - (xfact / 2.0f);
+		float offsety2 = getOffsetY(corners[next + 1], corners[next]);// + (yfact / 2.0f);
+		posi start(offsetx1 * width, offsety1 * height);
+		mainTarget->line(start, posi(offsetx2 * width, offsety2 * height), get_cpix('#', FWHITE|BBLACK));
+		if (mainTarget->getSize().contains(start))
+			mainTarget->draw(start, get_cpix('X', FRED|BBLACK));
+	}
+}
+
+overlay_values &shown() {
+	return renderSnapshot->values;
+}
+
+void displayStats() {
+		overlay_values &v = shown();
+		float values[] = {
+			v.environment,
+			v.health,
+			v.safety,
+			v.traffic,
+			v.education,
+			v.landvalue
+		};
+		const char *text[] = {
+			"Environment",
+			"Health",
+			"Safety",
+			"Traffic",
+			"Education",
+			"Land Value"
+		};
+		int width = adv::width / 3 - 5;
+		int height = 3;
+		int widthOffset = adv::width / 3;
+		for (int xi = 0; xi < 3; xi++) {
+			for (int yi = 0; yi < 2; yi++) {
+				//float value = float(rand() % 255) / 255;
+				float value = values[yi * 3 + xi];
+				
+				pixel pix = pixel((1.0f - value)  * 255, value * 255, 0);
+				wchar_t ch;
+				color_t co;
+				
+				getDitherColored(pix.r, pix.g, pix.b, &ch, &co);
+				
+				int characters = width * value;
+				
+				adv::write(xi * widthOffset, yi * height, text[yi * 3 + xi]);
+				for (int i = 0; i < width; i++) {
+					if (i > characters) {
+						ch = '#';
+						co = FWHITE|BBLACK;
+					}
+					adv::write(xi * widthOffset + i, yi * height + 1, ch, co);
+				}
+				//Lowest and highest tile on the map
+				plane_stats &stats = v.fieldStats[yi * 3 + xi];
+				if (stats.count) {
+					co = FWHITE|BBLACK;
+					adv::write(xi * widthOffset + int(width * stats.min), yi * height + 1, L'[', co);
+					adv::write(xi * widthOffset + std::min(int(width * stats.max), width - 1), yi * height + 1, L']', co);
+				}
+			}
+		}
+		
+		//RCI
+		auto showBarChart = [&](int x, int y, int height, float norm, cpix fillChar) {
+			adv::write(x, y, '-');
+			adv::write(x, y + height +1, '-');
+			adv::line(x,y+1,x,y+height,L'|', FWHITE|BBLACK);
+			int charFill = norm * (height-1);
+			for (int i = 0; i < charFill; i++) {
+				adv::write(x,y+height-i,fillChar.ch,fillChar.co);
+			}
+		};
+		
+		showBarChart(adv::width-3, 0, 8, v.residentialDemand, { L'|', BGREEN|FBLACK });
+		showBarChart(adv::width-2, 0, 8, v.commercialDemand, { L'|', BBLUE|FBLACK });
+		showBarChart(adv::width-1, 0, 8, v.industrialDemand, { L'|', BYELLOW|FBLACK });
+		screenDirty.mark({0, 0, adv::width, 10});
+}
+
+void displayDate() {
+	char buf[30];
+	snprintf(&buf[0], 29, "%i/%i", shown().month, shown().day);
+	adv::write(adv::width-4-strlen(&buf[0]),0,&buf[0]);
+	screenDirty.mark({0, 0, adv::width, 1});
+}
+
+void displayInfo() {
+	displayXY();
+	overlay_values &v = shown();
+	int y = 0;
+	auto printVar = [&](const char* varname, float value) {
+		char buf[100];
+		int i = snprintf(&buf[0], 99, "%s: %.2f", varname, value);
+		adv::write(0,y++,&buf[0]);
+	};
+	auto printSize = [&](const char* varname, sizei value) {
+		char buf[100];
+		int i = snprintf(&buf[0], 99, "%s: %i %i %i %i", varname, value.x, value.y, value.width, value.height);
+		adv::write(0,y++,&buf[0]);
+	};
+	printVar("viewX", viewX);
+	printVar("viewY", viewY);
+	printVar("scale", scale);
+	printVar("selectorTileId", tileSelector.selectedId);
+	printSize("selectorXYWH", tileSelector.selected.size);
+	printVar("waterSupply", v.waterSupply);
+	printVar("waterDemand", v.waterDemand);
+	printVar("waterNetworks", v.waterNetworks);
+	network_stats &ns = v.water;
+	printVar("netTickMs", ns.tick / 1000.0f);
+	printVar("netDiscoverMs", ns.discover / 1000.0f);
+	printVar("netWalkMs", ns.walk / 1000.0f);
+	printVar("netConsumersMs", ns.consumers / 1000.0f);
+	printVar("netAllocateMs", ns.allocate / 1000.0f);
+	printVar("netSolveMs", ns.duration / 1000.0f);
+	printVar("netFrames", ns.frames);
+	printVar("netComponents", ns.components);
+	printVar("netProviders", ns.providers);
+	printVar("netConsumers", ns.users);
+	{
+		char buf[100];
+		int len = snprintf(&buf[0], 99, "netSizes:");
+		for (int i = 0; i < NETWORK_HISTOGRAM_BUCKETS && len < 90; i++)
+			len += snprintf(&buf[len], 99 - len, " %i", ns.histogram[i]);
+		adv::write(0,y++,&buf[0]);
+	}
+	printVar("retained_objects", retained_targets.size());
+	printVar("retainedKB", retained_targets.bytes / 1024.0f);
+	printVar("retainedHits", retained_targets.hits);
+	printVar("retainedMisses", retained_targets.misses);
+	printVar("retainedEvictions", retained_targets.evictions);
+	printVar("terrainKB", terrain.buffers.bytes / 1024.0f);
+	printVar("terrainBuilds", terrain.builds);
+	printVar("terrainReused", terrain.reused);
+	printSize("mainTarget", mainTarget->getSize());
+	printSize("immediateTarget", immediateTarget->getSize());
+	printVar("instanceCount", registry.instances.size());
+	printVar("placeableCount", registry.placeable.size());
+	printVar("placementMode", placementMode ? 1.0f : 0.0f);
+	printVar("waterView", waterView ? 1.0f : 0.0f);
+	printVar("infoMode", infoMode ? 1.0f : 0.0f);
+	printVar("environment", v.environment);
+	printVar("health", v.health);
+	printVar("safety", v.safety);
+	printVar("traffic", v.traffic);
+	printVar("education", v.education);
+	printVar("landvalue", v.landvalue);
+	printVar("clinicCoverage", v.covered[SERVICE_CLINIC]);
+	printVar("schoolCoverage", v.covered[SERVICE_SCHOOL]);
+	printVar("policeCoverage", v.covered[SERVICE_POLICE]);
+	printVar("comPop", v.commercialPopulation);
+	printVar("comJob", v.commercialJobs);
+	printVar("comDem", v.commercialDemand);
+	printVar("indPop", v.industrialPopulation);
+	printVar("indJob", v.industrialJobs);
+	printVar("indDem", v.industrialDemand);
+	printVar("resCap", v.residentialCapacity);
+	printVar("resDem", v.residentialDemand);
+	printVar("pop", v.population);
+	printVar("simTick", renderSnapshot->tick);
+	printVar("simSpeed", v.speed);
+	printVar("roadNodes", v.roadNodes);
+	printVar("routeHits", v.routeHits);
+	printVar("routeMisses", v.routeMisses);
+	printVar("lodChunks", v.lodChunks);
+	printVar("snapshotRows", v.snapshotRows);
+	printVar("lotsQueued", v.lotsQueued);
+	printVar("lotsBuilt", v.lotsBuilt);
+	screenDirty.mark({0, 0, 100, y});
 }
 
-tileBase *instance_registry::getInstance(int id) {
-	for (auto _t : instances) {
-		if (_t->id == id)
-			return _t;
+/*
+Machine readable stats, one JSON object per line
+*/
+void dumpStats(const char *path) {
+	FILE *f = fopen(path, "w");
+	if (!f) {
+		fprintf(logFile, "Failed to open %s\n", path);
+		return;
 	}
-	return nullptr;
+	shown().water.dump(f, "water");
+	fclose(f);
 }
 
-tileBase *instance_registry::addPlaceable(tileBase *t) {
-	placeable.push_back(t);
-	return t;
-}
-
-tileBase *instance_registry::getPlaceable(int id) {
-	return placeable[id];
+/*
+Tell the simulation which tile is in the middle of the screen and how far the screen reaches
+*/
+void publishView() {
+	float width = getWidth(), height = getHeight();
+	posf center = getTileXY(adv::width / 2.0f / width, adv::height / 2.0f / height);
+	posf corners[4] = {
+		getTileXY(0, 0),
+		getTileXY(adv::width / width, 0),
+		getTileXY(0, adv::height / height),
+		getTileXY(adv::width / width, adv::height / height)
+	};
+	float radius = 0;
+	for (posf c : corners)
+		radius = std::max(radius, std::max(fabsf(c.x - center.x), fabsf(c.y - center.y)));
+	lod.setView(center, radius);
 }
 
-void _game::init(sizei mapsize) {
-	srand(time(NULL));
-	
+void resetView() {
 	viewX = 1;
 	viewY = 2;
 	
@@ -1684,336 +4439,790 @@ void _game::init(sizei mapsize) {
 	statsMode = false;
 	plopsOnly = false;
 	graphicsUpdate = true;
-	
-	waterSupply = 0;
-	waterDemand = 0;
-	waterNetworks = 0;
-	
-	residentialDemand = 0.5f;
-	commercialDemand = 0.5f;
-	industrialDemand = 0.5f;
-	
-	day = 1;
-	month = 1;
-	
-	environment = 0.5f;
-	health = 0.5f;
-	safety = 0.5f;
-	traffic = 0.5f;
-	education = 0.5f;
-	landvalue = 0.5f;
-	
-	//init_plops();
+}
 
-	if (tileMap)
-		delete [] tileMap;
-	
-	mapSize = mapsize;
-	tileMapWidth = mapSize.width;
-	tileMapHeight = mapSize.height;
-	tileMap = new tilePartial[tileMapWidth * tileMapHeight];
+std::vector<tilePartial> drawnTiles; //Tiles as they were last drawn
+sizei drawnSelector; //Tiles the selector was last drawn over
 
-	for (int y = 0; y < tileMapHeight; y++) {
-		for (int x = 0; x < tileMapWidth; x++) {
-			tileEvent e(tileComplete(grass_tile.clone(), &partially_garbage, {x,y,1,1}));
-			game.place(e.with(0, SILENT));
-			if (rand() % 2 == 0);
-			if (rand() % 4 == 0);
-		}
-	}
+//Screen area a tile change can show in, its own sprite and the neighbours connecting to it
+sizei tileDirtyArea(int x, int y) {
+	sizei area = tileBase::getRenderArea({x,y,1,1});
+	int padX = DIRTY_PAD_TILES * getWidth();
+	int padY = DIRTY_PAD_TILES * getHeight();
+	return {area.x - padX, area.y - area.height - padY, area.width + padX * 2, area.height + padY * 2};
+}
 
-	game.place({0,0,tileMapWidth,tileMapHeight}, grass_tile.clone());
-	fprintf(logFile, "grass_tile %p\n", grass_tile.clone());
-	game.place({2,2,1,1}, water_tower_plop.clone());
-	game.place({3,2,1,1}, water_tower_plop.clone());
-	game.place({4,2,1,1}, water_tower_plop.clone());
-	game.place({5,2,1,1}, water_tower_plop.clone());
-	game.place({2,4,2,2}, building3_plop.clone());
-	game.place({4,4,2,1}, building2_plop.clone());
+void markTiles(sizei tiles) {
+	sizei corners[4] = {
+		tileDirtyArea(tiles.x, tiles.y),
+		tileDirtyArea(tiles.x + tiles.width - 1, tiles.y),
+		tileDirtyArea(tiles.x, tiles.y + tiles.height - 1),
+		tileDirtyArea(tiles.x + tiles.width - 1, tiles.y + tiles.height - 1)
+	};
+	int x0 = INT_MAX, y0 = INT_MAX, x1 = INT_MIN, y1 = INT_MIN;
+	for (sizei &c : corners) {
+		x0 = std::min(x0, c.x);
+		y0 = std::min(y0, c.y);
+		x1 = std::max(x1, c.x + c.width);
+		y1 = std::max(y1, c.y + c.height);
+	}
+	screenDirty.mark({x0, y0, x1 - x0, y1 - y0});
 }
 
-tilePartial *getPartial(int x, int y) {
-	if (x >= tileMapWidth || x < 0 || y >= tileMapHeight || y < 0) {
-		fprintf(logFile, "Out of bounds: %i %i\n", x, y);
-		return &(partially_garbage = tilePartial());//&tiles::DEFAULT_TILE->defaultState;
+//Mark the visible tiles that changed since they were drawn, costs what is on screen
+void markChangedTiles() {
+	world_snapshot *snapshot = viewSnapshot;
+	if (!snapshot)
+		return;
+	if (drawnTiles.size() != snapshot->tiles.size()) {
+		drawnTiles = snapshot->tiles;
+		screenDirty.markAll();
+		return;
 	}
-	return &tileMap[y * tileMapWidth + x];
-}
 
-tilePartial *getPartial(posi p) {
-	return getPartial(p.x,p.y);
+	sizei map = snapshot->mapSize;
+	tile_range range = visibleTiles();
+	int lastColumn = std::min(range.lastColumn(), map.width - 1);
+	for (int x = std::max(range.firstColumn(), 0); x <= lastColumn; x++) {
+		int lastRow = std::min(range.lastRow(x), map.height - 1);
+		for (int y = std::max(range.firstRow(x), 0); y <= lastRow; y++) {
+			tilePartial &drawn = drawnTiles[y * map.width + x];
+			tilePartial &now = snapshot->tiles[y * map.width + x];
+			if (drawn.id == now.id && drawn.data.b == now.data.b)
+				continue;
+			drawn = now;
+			markTiles({x, y, 1, 1});
+		}
+	}
 }
 
-tileComplete getComplete(int x, int y) {
-	tileComplete tc(nullptr, nullptr, {x,y,1,1});
-	tc.partial = getPartial(x,y);
-	tc.parent = registry.getInstance(tc.partial->id);
-	tc.plop_instance = nullptr;
-	if (tc.partial->isPlop())
-		tc.plop_instance = (plop*)registry.getInstance(tc.partial->getPlopId());
-	return tc;
+void markDirty(bool fresh) {
+	sizei screen = mainTarget->getSize();
+	if (screenDirty.width * DIRTY_CELL_WIDTH < screen.width || screenDirty.height * DIRTY_CELL_HEIGHT < screen.height)
+		screenDirty.resize(screen.length());
+
+	view_state view = { viewX, viewY, scale, waterView, plopsOnly, placementMode, screen };
+	bool moved = !(view == drawnView);
+	drawnView = view;
+
+	//The water view also shows network state that is not in the tiles
+	if (moved || graphicsUpdate || (waterView && fresh))
+		screenDirty.markAll();
+	if (moved || fresh)
+		markChangedTiles();
+	//The selector blinks, where it was drawn last comes back when it moves
+	if (placementMode) {
+		markTiles(drawnSelector);
+		markTiles(tileSelector.selected.size);
+		drawnSelector = tileSelector.selected.size;
+	}
 }
 
-tileComplete getComplete(posi p) {
-	return getComplete(p.x,p.y);
+//Copy the dirty cells of the map buffer to the console, empty cells blank what was there
+void presentDirty(buffer_target *bt) {
+	sizei size = bt->getSize();
+	cpix blank = get_cpix(' ', FWHITE|BBLACK);
+	for (int cy = 0; cy < screenDirty.height; cy++) {
+		for (int cx = 0; cx < screenDirty.width; cx++) {
+			if (!screenDirty.cell(cx, cy))
+				continue;
+			for (int y = cy * DIRTY_CELL_HEIGHT; y < std::min((cy + 1) * DIRTY_CELL_HEIGHT, size.height); y++) {
+				for (int x = cx * DIRTY_CELL_WIDTH; x < std::min((cx + 1) * DIRTY_CELL_WIDTH, size.width); x++) {
+					cpix pix = *bt->get({x, y});
+					immediateTarget->draw(posi(x, y), pix.ch ? pix : blank);
+				}
+			}
+		}
+	}
 }
 
-tileEvent getEvent(sizei p) {
-	tileEvent e = getComplete(p);
-	e.size = p;
-	return e;
+/*
+Only the dirty cells of the map are drawn and sent to the console
+Overlays are drawn on top every frame and mark their cells so the map under them comes back
+*/
+void display(bool fresh) {
+	if (placementMode)
+		centerDisplay();
+
+	markDirty(fresh);
+
+	buffer_target *bt = mainTarget->is_retained_mode() ? (buffer_target*)mainTarget : nullptr;
+	if (!bt) {
+		adv::clear();
+	} else if (screenDirty.any) {
+		bt->clear(screenDirty);
+		bt->clip = &screenDirty;
+		bt->stale = true;
+	}
+
+	if (!bt || screenDirty.any) {
+		displayEdges();
+
+		displayTileMap();
+
+		if (placementMode)
+			tileSelector.render();
+	}
+
+	if (bt && screenDirty.any) {
+		presentDirty(bt);
+		bt->clip = nullptr;
+		bt->stale = false;
+	}
+	screenDirty.reset();
+	
+	if (statsMode)
+		displayStats();
+	
+	displayDate();
+	
+	if (infoMode) 
+		displayInfo();
 }
 
 #pragma endregion
 
-#pragma region //Display functions
+#pragma region //Simulation
 
-void displayTileMap() {
-	float width = getWidth();
-	float height = getHeight();
+/*
+Edits sent from input to the simulation thread
+*/
+struct sim_command {
+	enum KIND {
+		PLACE = 1, DESTROY, PLACE_PIPE, DESTROY_PIPE, RESET, SKIP_MONTH
+	};
+	int kind;
+	sizei size;
+	int placeable;
+	unsigned int seed = 0; //RESET only
+};
 
-	sizei screen = mainTarget->getSize();
-	sizei map = game.getMapSize();
+std::vector<sim_command> commandQueue;
+std::mutex commandMutex;
+std::atomic<bool> simRunning(false);
+std::thread simThread;
+unsigned long simTicks = 0;
+unsigned long simDays = 0;
+unsigned long worldVersion = 0; //Bumped by anything the renderer can see
+unsigned long publishedVersion = -1;
 
-	tileComplete tc;
-	tileEvent e;
+/*
+Fixed timestep for the simulation thread
+Wall time is accumulated and paid out in whole ticks,
+at most maxSteps per call so a stall does not snowball
+*/
+struct sim_clock {
+	typedef std::chrono::steady_clock clock;
+
+	std::atomic<float> ticksPerSecond{31.0f};
+	std::atomic<float> speed{1.0f};
+	int maxSteps = 8;
 
-	buffer_target *bt = nullptr;
-	if (mainTarget->is_retained_mode()) {
-		bt = (buffer_target*)mainTarget;
-		if (graphicsUpdate) {
-			bt->clear();
-			bt->stale = true;
+	clock::time_point last;
+	double accumulator = 0;
+
+	void reset() {
+		last = clock::now();
+		accumulator = 0;
+	}
+
+	double getInterval() {
+		return 1.0 / (ticksPerSecond * speed);
+	}
+
+	//Ticks owed since the last call
+	int advance() {
+		clock::time_point now = clock::now();
+		accumulator += std::chrono::duration<double>(now - last).count();
+		last = now;
+
+		double interval = getInterval();
+		int steps = accumulator / interval;
+		if (steps > maxSteps) {
+			steps = maxSteps;
+			accumulator = 0;
+		} else {
+			accumulator -= steps * interval;
 		}
+		return steps;
 	}
 
-	for (int x = map.width - 1; x > - 1; x--) {
-		for (int y = 0; y < map.height; y++) {			
-			sizei renderArea = tileBase::getRenderArea({x,y,1,1});
-			//renderArea.height = renderArea.height - renderArea.y;
-			renderArea.y -= getHeight();
+	clock::time_point nextDue() {
+		double remaining = getInterval() - accumulator;
+		if (remaining < 0)
+			remaining = 0;
+		return last + std::chrono::duration_cast<clock::duration>(std::chrono::duration<double>(remaining));
+	}
 
-			if (!screen.overlaps(renderArea))
-				continue;
-			
-			tc = getComplete(x,y);
-			e = tileEvent(tc);
-			tilePartial *partial = tc.partial;
+	void setSpeed(float multiplier) {
+		speed = multiplier < 0.25f ? 0.25f : multiplier > 16.0f ? 16.0f : multiplier;
+	}
+} simClock;
 
-			if (waterView) {
-				dirt_tile.render(e);
-				if (partial->hasUnderground(UNDERGROUND_WATER_PIPE))
-					water_pipe_tile.render(e);
-			} else {
-				if (tc.parent && !plopsOnly)
-					tc.parent->render(e);
-				if (tc.plop_instance) {
-					tc.plop_instance->render(e);
+const std::chrono::microseconds frameInterval(1000000 / 60);
+
+/*
+Recorded session, the seed and every command with the tick it was applied on
+
+Header: "CCRP", version, seed, map width, map height
+Record: tick, kind, placeable, x, y, width, height, and a seed for RESET
+Ends with a kind 0 record on the last simulated tick
+*/
+struct session_file {
+	static const uint32_t VERSION = 1;
+
+	FILE *file = nullptr;
+	bool recording = false;
+	bool replaying = false;
+	unsigned int seed = 0;
+	sizei map;
+
+	//Next command waiting to be replayed
+	bool hasNext = false;
+	uint32_t nextTick;
+	sim_command next;
+
+	bool openRecord(const char *path, unsigned int seed, sizei map) {
+		file = fopen(path, "wb");
+		if (!file)
+			return false;
+		int32_t header[4] = { (int32_t)VERSION, (int32_t)seed, map.width, map.height };
+		fwrite("CCRP", 1, 4, file);
+		fwrite(&header[0], sizeof(header), 1, file);
+		this->seed = seed;
+		this->map = map;
+		recording = true;
+		return true;
+	}
+
+	bool openReplay(const char *path) {
+		file = fopen(path, "rb");
+		if (!file)
+			return false;
+		char magic[4];
+		int32_t header[4];
+		if (fread(&magic[0], 1, 4, file) != 4 || memcmp(&magic[0], "CCRP", 4) != 0 ||
+			fread(&header[0], sizeof(header), 1, file) != 1 || header[0] != VERSION) {
+			fclose(file);
+			file = nullptr;
+			return false;
+		}
+		seed = header[1];
+		map = sizei(0, 0, header[2], header[3]);
+		replaying = true;
+		readNext();
+		return true;
+	}
+
+	void write(unsigned long tick, sim_command c) {
+		uint32_t t = tick;
+		uint8_t kind = c.kind;
+		int16_t fields[5] = {
+			(int16_t)c.placeable, (int16_t)c.size.x, (int16_t)c.size.y,
+			(int16_t)c.size.width, (int16_t)c.size.height
+		};
+		fwrite(&t, sizeof(t), 1, file);
+		fwrite(&kind, sizeof(kind), 1, file);
+		fwrite(&fields[0], sizeof(fields), 1, file);
+		if (c.kind == sim_command::RESET) {
+			uint32_t s = c.seed;
+			fwrite(&s, sizeof(s), 1, file);
+		}
+	}
+
+	void readNext() {
+		uint8_t kind;
+		int16_t fields[5];
+		hasNext = fread(&nextTick, sizeof(nextTick), 1, file) == 1 &&
+				  fread(&kind, sizeof(kind), 1, file) == 1 &&
+				  fread(&fields[0], sizeof(fields), 1, file) == 1;
+		if (!hasNext)
+			return;
+		next.kind = kind;
+		next.placeable = fields[0];
+		next.size = sizei(fields[1], fields[2], fields[3], fields[4]);
+		next.seed = 0;
+		if (kind == sim_command::RESET) {
+			uint32_t s;
+			hasNext = fread(&s, sizeof(s), 1, file) == 1;
+			next.seed = s;
+		}
+	}
+
+	//Queue commands recorded for this tick
+	void feed(unsigned long tick, std::vector<sim_command> &pending) {
+		while (hasNext && nextTick <= tick) {
+			if (next.kind)
+				pending.push_back(next);
+			readNext();
+		}
+	}
+
+	bool finished() {
+		return replaying && !hasNext;
+	}
+
+	void close(unsigned long ticks) {
+		if (recording)
+			write(ticks ? ticks - 1 : 0, sim_command{0, {}, 0, 0});
+		if (file)
+			fclose(file);
+		file = nullptr;
+		recording = replaying = hasNext = false;
+	}
+} session;
+
+/*
+FNV-1a over the map and water storage
+Plops hash by the placeable they were cloned from, instance ids depend on selector use
+*/
+uint64_t worldHash() {
+	uint64_t hash = 14695981039346656037ULL;
+	auto mix = [&](const void *p, size_t n) {
+		const unsigned char *b = (const unsigned char*)p;
+		for (size_t i = 0; i < n; i++)
+			hash = (hash ^ b[i]) * 1099511628211ULL;
+	};
+
+	//Hash the live map, not what the main thread last drew
+	world_snapshot *view = viewSnapshot;
+	viewSnapshot = nullptr;
+
+	sizei map = game.getMapSize();
+	for (int y = 0; y < map.height; y++) {
+		for (int x = 0; x < map.width; x++) {
+			tileComplete tc = getComplete(x,y);
+			tilePartial t = *tc.partial;
+			//Destroyed plops leave their id behind
+			t.data.c[1] = 0;
+			if (tc.plop_instance) {
+				t.data.c[1] = tc.plop_instance->initial_id;
+				mix(&tc.plop_instance->population, sizeof(int));
+				network_provider *net = tc.plop_instance->net;
+				if (net && net->water && net->water->getSlot() >= 0) {
+					net_t stored = networkTable.stored[net->water->getSlot()];
+					mix(&stored, sizeof(stored));
 				}
 			}
+			mix(&t.id, sizeof(t.id));
+			mix(&t.data.b, sizeof(t.data.b));
 		}
 	}
+	mix(&waterSupply, sizeof(waterSupply));
+	mix(&waterDemand, sizeof(waterDemand));
 
-	if (bt && mainTarget->is_retained_mode()) {
-		bt->stale = false;
-		immediateTarget->draw(bt);
+	viewSnapshot = view;
+	return hash;
+}
+
+void pushCommand(sim_command c) {
+	//Replayed sessions only take recorded input
+	if (session.replaying)
+		return;
+	std::lock_guard<std::mutex> lock(commandMutex);
+	commandQueue.push_back(c);
+}
+
+void applyCommand(sim_command c) {
+	worldVersion++;
+	switch (c.kind) {
+		case sim_command::PLACE: {
+			//Same as cloning the selector's copy of the placeable
+			tileBase *base = registry.getPlaceable(c.placeable)->clone();
+			base->setSize(getEvent(c.size));
+			game.place(c.size, base);
+			break;
+		}
+		case sim_command::DESTROY:
+			game.destroy(c.size);
+			break;
+		case sim_command::PLACE_PIPE:
+			water_pipe_tile.onPlaceEvent(getComplete(c.size));
+			break;
+		case sim_command::DESTROY_PIPE:
+			water_pipe_tile.onDestroyEvent(getComplete(c.size));
+			break;
+		case sim_command::RESET:
+			game.init(c.size, c.seed);
+			break;
+		case sim_command::SKIP_MONTH:
+			month++;
+			day = 1;
+			break;
 	}
 }
 
-void displayXY() {
-	posf p = {getScreenOffsetX(0.2,0),getScreenOffsetY(0.5,0)};
-	//posf _x = {1,0}, _y = {0,1};
-	posf x = getOffsetXY({4,0}).add(-viewX, -viewY);
-	posf y = getOffsetXY({0,4}).add(-viewX, -viewY);
-	x.x *= getCharacterYoverX();
-	y.x *= getCharacterYoverX();
+//Caller holds worldMutex exclusively
+void applyCommands() {
+	std::vector<sim_command> pending;
+	{
+		std::lock_guard<std::mutex> lock(commandMutex);
+		pending.swap(commandQueue);
+	}
+	if (session.replaying)
+		session.feed(simTicks, pending);
+	for (sim_command &c : pending) {
+		if (session.recording)
+			session.write(simTicks, c);
+		applyCommand(c);
+	}
+}
 
-	adv::line(p.x,p.y,p.x + x.x,p.y + x.y,'X',FRED|BBLACK);
-	adv::line(p.x,p.y,p.x + y.x,p.y + y.y,'Y',FGREEN|BBLACK);
+/*
+Residents move in while there are free jobs within commuting distance, workers fill jobs while there are residents
+Nobody moves in without road access
+*/
+void updateOccupancy(plop *p) {
+	int jobs = commercialJobs + industrialJobs;
+	int workers = commercialPopulation + industrialPopulation;
+	bool grow = p->zone == ZONING_RESIDENTIAL ? population <= jobs && commute.get(p->size) <= COMMUTE_MAX : workers < population;
+	grow = grow && roadAccess.has(p);
+	p->setPopulation(p->population + (grow ? 1 : -1));
 }
 
-void centerDisplay() {
-	sizei selected = tileSelector.selected.size;
-	posi selectedCenter = selected.center(); //tilespace
-	int area = selected.area();
-	viewX = 0;
-	viewY = 0;
-	posf map = {(float)-selectedCenter.x, (float)-selectedCenter.y}; //tilespace
-	posf selectedOffset = getOffsetXY(map); //screenspace before scaling
-	posf off = {(scale / 4 * getCharacterYoverX()), scale / 4}; //screenspace
+void randomTick(tileComplete tc) {
+	tc.parent->onRandomEvent(tc);
+	if (tc.plop_instance && tc.plop_instance->zone != ZONING_NONE)
+		updateOccupancy(tc.plop_instance);
+	
+	if (tc.partial->hasUnderground(UNDERGROUND_WATER_PIPE))
+		//((water_pipe*)(tiles::WATER_PIPE))->updateWater(tc);
+		water_pipe_tile.onUpdateEvent(tc);
+}
+
+/*
+Pay the random ticks a chunk owes in one pass
+Every tile gets its events at once and each plop moves its share of occupants in one step
+*/
+void settleChunk(int c) {
+	double owed = lod.owedEvents(c);
+	lod.settledAt[c] = lod.farEvents;
+	if (owed < 1.0)
+		return;
+
+	float perTile = owed / (LOD_CHUNK * LOD_CHUNK);
+	int x0 = (c % lod.chunksX) * LOD_CHUNK, y0 = (c / lod.chunksX) * LOD_CHUNK;
+	for (int y = y0; y < std::min(y0 + LOD_CHUNK, tileMapHeight); y++) {
+		for (int x = x0; x < std::min(x0 + LOD_CHUNK, tileMapWidth); x++) {
+			tileComplete tc = getComplete(x, y);
+			tc.parent->onRandomEvent(tc);
+			if (tc.partial->hasUnderground(UNDERGROUND_WATER_PIPE))
+				water_pipe_tile.onUpdateEvent(tc);
+
+			plop *p = tc.plop_instance;
+			if (!p || p->zone == ZONING_NONE || p->size.x != x || p->size.y != y)
+				continue;
+			int steps = roundf(perTile * p->size.width * p->size.height);
+			for (int i = 0; i < steps; i++)
+				updateOccupancy(p);
+		}
+	}
+}
+
+void settleAll() {
+	for (int c = 0; c < lod.chunksX * lod.chunksY; c++)
+		settleChunk(c);
+}
+
+/*
+One step of random ticks, calendar and scheduled work
+Caller holds worldMutex exclusively, ticks change tiles and network values the renderer reads
+*/
+void simulationTick() {
+	commute.update();
+	coverage.update();
+
+	//Issue random ticks
+	//1/10 chance for each
+	//100 tiles, issue 10 ticks
+	//200 tiles, issue 20 ticks
+	//Only the chunks around the view, the rest owe them
+	lod.update(!session.recording && !session.replaying);
+	{
+		int x0 = std::min(lod.x0 * LOD_CHUNK, tileMapWidth), y0 = std::min(lod.y0 * LOD_CHUNK, tileMapHeight);
+		int w = std::min(lod.x1 * LOD_CHUNK, tileMapWidth) - x0;
+		int h = std::min(lod.y1 * LOD_CHUNK, tileMapHeight) - y0;
+		//Box can be empty with the view off the map
+		int ticksToIssue = w > 0 && h > 0 ? w * h * 0.01f : 0;
+		//ignore repeat for now
+		for (int i = 0; i < ticksToIssue; i++) {
+			int x = x0 + rand() % w;
+			int y = y0 + rand() % h;
+			randomTick(getComplete(x, y));
+		}
+
+		//Pay what the chunks owed while they were far, this tick ran directly
+		for (int cy = lod.y0; cy < lod.y1; cy++)
+			for (int cx = lod.x0; cx < lod.x1; cx++)
+				settleChunk(cy * lod.chunksX + cx);
+		lod.farEvents += 0.01;
+		for (int cy = lod.y0; cy < lod.y1; cy++)
+			for (int cx = lod.x0; cx < lod.x1; cx++)
+				lod.settledAt[cy * lod.chunksX + cx] = lod.farEvents;
+	}
+	
+	//game logic
+	if (microday++ > 30) {//once a second
+		microday = 0;
+		worldVersion++;
+		simDays++;
+		day++;
+		if (day > 31) {
+			month++;
+			day = 1;
+			fprintf(logFile, "Month %i\n", month);
+		}
+	}
+	
+	//New month, exact values everywhere
+	if (microday == 0 && day == 1 && lod.active)
+		settleAll();
+
+	if (microday == 0)
+		fields.step(day == 1);
+
+	if (microday == 0 && day == 1)
+		coverage.publish();
+
+	if (microday == 0)
+	switch (day) {
+		case 3: {
+			if (!waterJob.isRunning())
+				waterJob.start(WATER, isWaterNetwork);
+			break;
+		}
+	}
 
-			//tilespace        tilespace
-	off.x = selectedCenter.x - (selected.x / scale * 2);
-	off.y = selectedCenter.y - (selected.y / scale);
+	if (waterJob.step(networkBudget)) {
+		worldVersion++;
+		waterSupply = netf(waterJob.result.supply);
+		waterDemand = netf(waterJob.result.demand);
+		waterNetworks = waterJob.result.networks;
+	}
 
-	off.x = 2; //tilespace
-	off.y = 5;
+	simTicks++;
+}
 
-	//viewX and viewY are in screenspace, before scaling
+overlay_values captureOverlay() {
+	overlay_values v;
+	v.waterSupply = waterSupply;
+	v.waterDemand = waterDemand;
+	v.waterNetworks = waterNetworks;
+	v.commercialJobs = commercialJobs;
+	v.commercialPopulation = commercialPopulation;
+	v.commercialDemand = commercialDemand;
+	v.industrialJobs = industrialJobs;
+	v.industrialPopulation = industrialPopulation;
+	v.industrialDemand = industrialDemand;
+	v.residentialCapacity = residentialCapacity;
+	v.population = population;
+	v.residentialDemand = residentialDemand;
+	v.environment = environment;
+	v.health = health;
+	v.safety = safety;
+	v.traffic = traffic;
+	v.education = education;
+	v.landvalue = landvalue;
+	for (int f = 0; f < FIELD_COUNT; f++)
+		v.fieldStats[f] = fields.stats[f];
+	for (int s = 0; s < SERVICE_COUNT; s++)
+		v.covered[s] = coverage.covered[s];
+	v.day = day;
+	v.month = month;
+	v.speed = simClock.speed;
+	v.water = waterJob.lastStats;
+	v.roadNodes = roads.nodes;
+	v.routeHits = roads.hits;
+	v.routeMisses = roads.misses;
+	v.lotsQueued = development.queue.size();
+	v.lotsBuilt = development.built + development.upgraded;
+	v.lodChunks = lod.active ? (lod.x1 - lod.x0) * (lod.y1 - lod.y0) : lod.chunksX * lod.chunksY;
+	return v;
+}
 
-	viewX = selectedOffset.x + getOffsetX(off);
-	viewY = selectedOffset.y + getOffsetY(off);
+void publishSnapshot() {
+	//Random ticks and growth change tiles without a new version
+	if (publishedVersion == worldVersion && !tilesTouched)
+		return;
 
-	//posf tileOffset = {40,20};
-	posf tileOffset = {adv::width / 4.0f, adv::height / 2.0f};
-	
-	//I don't know how this works
+	{
+		std::lock_guard<std::mutex> lock(snapshotMutex);
+		//Renderer has not taken the last one yet
+		if (snapshotFresh)
+			return;
+	}
 
-	viewX = selectedOffset.x + (tileOffset.x / scale); //5
-	viewY = selectedOffset.y + (tileOffset.y / scale); //2
-}
+	publishedVersion = worldVersion;
 
-void displayEdges() {
-	//Edges of the map
-	float corners[] = {
-		0.5f,-0.5f,
-		tileMapWidth+0.5f,-0.5f,
-		tileMapWidth+0.5f,tileMapHeight-0.5f,
-		0.5f,tileMapHeight-0.5f,
-		0.5f,-0.5f,
-	};
-	for (int i = 0; i < 8; i+=2) {
-		//break;
-		//int next = (i + 2) % 8;
-		int next = i + 2;
-		int width = getWidth();
-		int height = getHeight();
-		float offsetx1 = getOffsetX(corners[i + 1], corners[i]);// - (xfact / 2.0f);
-		float offsety1 = getOffsetY(corners[i + 1], corners[i]);// + (yfact / 2.0f);
-		float offsetx2 = getOffsetX(corners[next + 1], corners[next]);// - (xfact / 2.0f);
-		float offsety2 = getOffsetY(corners[next + 1], corners[next]);// + (yfact / 2.0f);
-		adv::line(offsetx1 * width, offsety1 * height, offsetx2 * width, offsety2 * height, '#', FWHITE|BBLACK);
-		adv::write(offsetx1 * width, offsety1 * height, 'X', FRED|BBLACK);
+	//Only rows written since this buffer last took them are copied
+	world_snapshot *s = writeSnapshot;
+	sizei map = game.getMapSize();
+	int rows = 0;
+	if (!(s->mapSize == map) || s->tiles.size() != (size_t)(map.width * map.height)) {
+		s->mapSize = map;
+		s->tiles.assign(tileMap, tileMap + map.width * map.height);
+		s->rowEdits = tileRowEdits;
+		rows = map.height;
+	} else {
+		for (int y = 0; y < map.height; y++) {
+			if (s->rowEdits[y] == tileRowEdits[y])
+				continue;
+			std::copy(tileMap + y * map.width, tileMap + (y + 1) * map.width, s->tiles.begin() + y * map.width);
+			s->rowEdits[y] = tileRowEdits[y];
+			rows++;
+		}
 	}
+	tileEpoch++;
+	tilesTouched = false;
+	writeSnapshot->values = captureOverlay();
+	writeSnapshot->values.snapshotRows = rows;
+	writeSnapshot->tick = simTicks;
+
+	std::lock_guard<std::mutex> lock(snapshotMutex);
+	std::swap(writeSnapshot, readySnapshot);
+	snapshotFresh = true;
 }
 
-void displayStats() {
-		const char *text[] = {
-			"Environment",
-			"Health",
-			"Safety",
-			"Traffic",
-			"Education",
-			"Land Value"
-		};
-		int width = adv::width / 3 - 5;
-		int height = 3;
-		int widthOffset = adv::width / 3;
-		for (int xi = 0; xi < 3; xi++) {
-			for (int yi = 0; yi < 2; yi++) {
-				//float value = float(rand() % 255) / 255;
-				float value = (&environment)[yi * 3 + xi];
-				
-				pixel pix = pixel((1.0f - value)  * 255, value * 255, 0);
-				wchar_t ch;
-				color_t co;
-				
-				getDitherColored(pix.r, pix.g, pix.b, &ch, &co);
-				
-				int characters = width * value;
-				
-				adv::write(xi * widthOffset, yi * height, text[yi * 3 + xi]);
-				for (int i = 0; i < width; i++) {
-					if (i > characters) {
-						ch = '#';
-						co = FWHITE|BBLACK;
-					}
-					adv::write(xi * widthOffset + i, yi * height + 1, ch, co);
-				}
-			}
+/*
+Render thread, take the newest snapshot if there is one
+Returns true if the snapshot changed
+*/
+bool acquireSnapshot() {
+	std::lock_guard<std::mutex> lock(snapshotMutex);
+	viewSnapshot = renderSnapshot;
+	if (!snapshotFresh)
+		return false;
+	std::swap(renderSnapshot, readySnapshot);
+	snapshotFresh = false;
+	viewSnapshot = renderSnapshot;
+	return true;
+}
+
+void simulationLoop() {
+	simClock.reset();
+	while (simRunning) {
+		int steps = simClock.advance();
+		for (int i = 0; i < steps; i++) {
+			std::unique_lock<std::shared_mutex> lock(worldMutex);
+			applyCommands();
+			//Growth places and destroys plops like commands do
+			development.update();
+			simulationTick();
 		}
-		
-		//RCI
-		auto showBarChart = [&](int x, int y, int height, float norm, cpix fillChar) {
-			adv::write(x, y, '-');
-			adv::write(x, y + height +1, '-');
-			adv::line(x,y+1,x,y+height,L'|', FWHITE|BBLACK);
-			int charFill = norm * (height-1);
-			for (int i = 0; i < charFill; i++) {
-				adv::write(x,y+height-i,fillChar.ch,fillChar.co);
-			}
-		};
-		
-		showBarChart(adv::width-3, 0, 8, residentialDemand, { L'|', BGREEN|FBLACK });
-		showBarChart(adv::width-2, 0, 8, commercialDemand, { L'|', BBLUE|FBLACK });
-		showBarChart(adv::width-1, 0, 8, industrialDemand, { L'|', BYELLOW|FBLACK });
+		{
+			std::shared_lock<std::shared_mutex> lock(worldMutex);
+			publishSnapshot();
+		}
+		std::this_thread::sleep_until(simClock.nextDue());
+	}
 }
 
-void displayDate() {
-	char buf[30];
-	snprintf(&buf[0], 29, "%i/%i", month,day);
-	adv::write(adv::width-4-strlen(&buf[0]),0,&buf[0]);
+void startSimulation() {
+	worldVersion++;
+	publishSnapshot();
+	acquireSnapshot();
+	simRunning = true;
+	simThread = std::thread(simulationLoop);
 }
 
-void displayInfo() {
-	displayXY();
-	int y = 0;
-	auto printVar = [&](const char* varname, float value) {
-		char buf[100];
-		int i = snprintf(&buf[0], 99, "%s: %.2f", varname, value);
-		adv::write(0,y++,&buf[0]);
-	};
-	auto printSize = [&](const char* varname, sizei value) {
-		char buf[100];
-		int i = snprintf(&buf[0], 99, "%s: %i %i %i %i", varname, value.x, value.y, value.width, value.height);
-		adv::write(0,y++,&buf[0]);
-	};
-	printVar("viewX", viewX);
-	printVar("viewY", viewY);
-	printVar("scale", scale);
-	printVar("selectorTileId", tileSelector.selectedId);
-	printSize("selectorXYWH", tileSelector.selected.size);
-	printVar("waterSupply", waterSupply);
-	printVar("waterDemand", waterDemand);
-	printVar("waterNetworks", waterNetworks);
-	printVar("retained_objects", retained_targets.size());
-	printSize("mainTarget", mainTarget->getSize());
-	printSize("immediateTarget", immediateTarget->getSize());
-	printVar("instanceCount", registry.instances.size());
-	printVar("placeableCount", registry.placeable.size());
-	printVar("placementMode", placementMode ? 1.0f : 0.0f);
-	printVar("waterView", waterView ? 1.0f : 0.0f);
-	printVar("infoMode", infoMode ? 1.0f : 0.0f);
-	printVar("environment", environment);
-	printVar("health", environment);
-	printVar("safety", safety);
-	printVar("traffic", traffic);
-	printVar("education", education);
-	printVar("landvalue", landvalue);
-	printVar("comPop", commercialPopulation);
-	printVar("comJob", commercialJobs);
-	printVar("comDem", commercialDemand);
-	printVar("indPop", industrialPopulation);
-	printVar("indJob", industrialJobs);
-	printVar("indDem", industrialDemand);
-	printVar("resCap", residentialCapacity);
-	printVar("resDem", residentialDemand);
-	printVar("pop", population);
-}
-
-void display() {
-	if (placementMode)
-		centerDisplay();
+void stopSimulation() {
+	if (!simRunning)
+		return;
+	simRunning = false;
+	simThread.join();
+}
 
-	displayEdges();
+#pragma endregion
 
-	displayTileMap();
+/*
+Run the day schedule for a number of months without a console
+A replayed session runs for exactly the recorded ticks instead
+Prints throughput, tick times, the world hash and the last network stats to stdout
+*/
+int routeChecks = 0; //Queries compared against a plain BFS after a headless run
 
-	if (placementMode)
-		tileSelector.render();
-	
-	if (statsMode)
-		displayStats();
-	
-	displayDate();
-	
-	if (infoMode) 
-		displayInfo();
+/*
+Random road tile pairs through getRoute, each asked twice so the cache answers the second,
+then again from a road next to the start, which must not be answered with the first route
+Returns how many disagreed with a BFS or gave a path that does not run from a to b
+*/
+int checkRoutes(int queries) {
+	std::vector<int> live, dist;
+	for (size_t n = 0; n < roads.tileOf.size(); n++)
+		if (roads.tileOf[n] != -1)
+			live.push_back(n);
+	if (live.empty())
+		return 0;
+
+	int bad = 0;
+	std::vector<int> path;
+	auto check = [&](int start, int goal) {
+		int ta = roads.tileOf[start], tb = roads.tileOf[goal];
+		posi a(ta % roads.width, ta / roads.width), b(tb % roads.width, tb / roads.width);
+		int cost = roads.getRoute(a, b, &path);
+		bool ok = cost == dist[goal];
+		if (ok && cost != -1)
+			ok = (int)path.size() == cost + 1 && path.front() == ta && path.back() == tb;
+		bad += !ok;
+	};
+	for (int q = 0; q < queries; q++) {
+		int start = live[rand() % live.size()], goal = live[rand() % live.size()];
+		roads.distances(start, dist);
+		check(start, goal);
+		check(start, goal);
+		for (int d = 0; d < 4; d++) {
+			int next = roads.adjacency[start * 4 + d];
+			if (next == -1)
+				continue;
+			roads.distances(next, dist);
+			check(next, goal);
+			break;
+		}
+	}
+	return bad;
 }
 
-#pragma endregion
+int runHeadless(int months, unsigned int seed) {
+	game.init({0,0,tileMapWidth,tileMapHeight}, seed);
+
+	fprintf(logFile, "[%li] Headless for %i months\n", time(0), months);
+
+	auto begin = std::chrono::steady_clock::now();
+	unsigned long startTicks = simTicks, startDays = simDays;
+	int target = month + months;
+	long long tickMax = 0;
+
+	while (session.replaying ? !session.finished() : month < target) {
+		auto tickStart = std::chrono::steady_clock::now();
+		applyCommands();
+		development.update();
+		simulationTick();
+		tickMax = std::max(tickMax, elapsedMicros(tickStart));
+	}
+
+	double seconds = elapsedMicros(begin) / 1000000.0;
+	unsigned long days = simDays - startDays;
+	unsigned long ticks = simTicks - startTicks;
+
+	printf("map %ix%i months %i days %lu ticks %lu seconds %.3f days/s %.1f ticks/s %.1f\n",
+		tileMapWidth, tileMapHeight, months, days, ticks, seconds,
+		days / seconds, ticks / seconds);
+	printf("tick avg %.1fus max %llius hash %016llx\n",
+		ticks ? seconds * 1000000.0 / ticks : 0.0, tickMax, (unsigned long long)worldHash());
+	waterJob.lastStats.dump(stdout, waterJob.getName());
+	if (routeChecks > 0)
+		printf("routes %i nodes %i mismatches %i\n", routeChecks, roads.nodes, checkRoutes(routeChecks));
+	session.close(simTicks);
+
+	fprintf(logFile, "[%li] Headless done\n", time(0));
+	fclose(logFile);
+	return 0;
+}
 
 void cleanupexit() {
+	stopSimulation();
+	fprintf(logFile, "[%li] Tick %lu hash %016llx\n", time(0), simTicks, (unsigned long long)worldHash());
+	session.close(simTicks);
 	fprintf(logFile, "Closing console\n");
 	adv::_advancedConsoleDestruct();
 	fprintf(logFile, "Exit\n");
@@ -2029,6 +5238,56 @@ int wmain() {
 
 	fprintf(logFile, "[%li] Opened log\n", time(0));
 
+	//CITY_MAP=WIDTHxHEIGHT
+	if (const char *mapEnv = getenv("CITY_MAP")) {
+		int w, h;
+		if (sscanf(mapEnv, "%ix%i", &w, &h) == 2 && w > 0 && h > 0) {
+			tileMapWidth = w;
+			tileMapHeight = h;
+		}
+	}
+
+	//CITY_LOD=TILES simulated past the edge of the view every tick, 0 for the whole map
+	if (const char *lodEnv = getenv("CITY_LOD"))
+		lodRadius = atoi(lodEnv);
+
+	//CITY_ROUTE_CHECK=QUERIES checks cached routes against a BFS at the end of a headless run
+	if (const char *routeEnv = getenv("CITY_ROUTE_CHECK"))
+		routeChecks = atoi(routeEnv);
+
+	//CITY_SPRITE_CACHE=KB of retained sprite buffers kept
+	if (const char *cacheEnv = getenv("CITY_SPRITE_CACHE"))
+		retained_targets.budget = (size_t)std::max(atoi(cacheEnv), 0) * 1024;
+
+	unsigned int seed = time(NULL);
+
+	//CITY_REPLAY=FILE replays a recorded session, CITY_RECORD=FILE records one
+	if (const char *replay = getenv("CITY_REPLAY")) {
+		if (!session.openReplay(replay)) {
+			fprintf(stderr, "Failed to open replay %s\n", replay);
+			return 1;
+		}
+		seed = session.seed;
+		tileMapWidth = session.map.width;
+		tileMapHeight = session.map.height;
+		fprintf(logFile, "[%li] Replaying %s seed %u\n", time(0), replay, seed);
+	} else
+	if (const char *record = getenv("CITY_RECORD")) {
+		if (!session.openRecord(record, seed, {0,0,tileMapWidth,tileMapHeight})) {
+			fprintf(stderr, "Failed to open record %s\n", record);
+			return 1;
+		}
+		fprintf(logFile, "[%li] Recording %s seed %u\n", time(0), record, seed);
+	}
+
+	//Time sliced solves commit on wall time, run them whole
+	if (session.recording || session.replaying)
+		networkBudget = 0;
+
+	//CITY_HEADLESS=MONTHS, no console, textures or render targets
+	if (const char *headless = getenv("CITY_HEADLESS"))
+		return runHeadless(atoi(headless) > 0 ? atoi(headless) : 1, seed);
+
 	colormapper_init_table();
 
 	fprintf(logFile, "[%li] Initialized color table\n", time(0));
@@ -2037,6 +5296,9 @@ int wmain() {
 	
 	grass_sprite_random.set(&grass_sprite);
 	grass_sprite_random.add(&water_pipe_sprite);
+	residential_zone_sprite.load();
+	commercial_zone_sprite.load();
+	industrial_zone_sprite.load();
 
 	fprintf(logFile, "[%li] Loaded texture\n", time(0));
 
@@ -2048,9 +5310,12 @@ int wmain() {
 
 	fprintf(logFile, "[%li] Set advanced console up\n", time(0));
 
-	game.init({0,0,tileMapWidth,tileMapHeight});
+	resetView();
+	game.init({0,0,tileMapWidth,tileMapHeight}, seed);
 
 	fprintf(logFile, "[%li] Game initialized\n", time(0));
+
+	startSimulation();
 	
 	int key = 0;
 	
@@ -2060,13 +5325,20 @@ int wmain() {
 	fprintf(logFile, "[%li] Game loop\n", time(0));
 
 	while (true) {
+		auto frameStart = std::chrono::steady_clock::now();
 		key = console::readKeyAsync();
 		
 		if (HASKEY(key, VK_ESCAPE) || HASKEY(key, 'q')) {
 			cleanupexit();
 		}
 
-		adv::clear();
+		//Nothing to show, skip the frame
+		bool fresh = acquireSnapshot();
+		if (key == 0 && !fresh && !placementMode && !infoMode) {
+			std::this_thread::sleep_until(frameStart + frameInterval);
+			continue;
+		}
+
 		graphicsUpdate = true;
 		
 		if (placementMode) {
@@ -2112,31 +5384,38 @@ int wmain() {
 			{
 				//Place
 				if (waterView) {
-					water_pipe_tile.onPlaceEvent(getComplete(tileSelector.selected.size));
+					pushCommand({sim_command::PLACE_PIPE, tileSelector.selected.size, 0});
 					break;
 				}
 
 				//Selected tile in its current state and size
-				game.place(tileSelector.selected.size, tileSelector.selected.parent->clone());
+				pushCommand({sim_command::PLACE, tileSelector.selected.size, tileSelector.selectedId});
 			}
 				break;
 			case 'x':
 			{
 				//Destroy
 				if (waterView) {
-					water_pipe_tile.onDestroyEvent(getComplete(tileSelector.selected.size));
+					pushCommand({sim_command::DESTROY_PIPE, tileSelector.selected.size, 0});
 					break;
 				}
 
 				//Destroy tile selector selected (which isn't meant for this)
-				game.destroy(tileSelector.selected.size);
+				pushCommand({sim_command::DESTROY, tileSelector.selected.size, 0});
 			}
 				break;
 			case '2':
+			{
+				//Cloning the next placeable adds an instance
+				std::unique_lock<std::shared_mutex> lock(worldMutex);
 				tileSelector.next();
+			}
 				break;
 			case '1':
+			{
+				std::unique_lock<std::shared_mutex> lock(worldMutex);
 				tileSelector.prev();
+			}
 				break;
 			default:
 				graphicsUpdate = false;
@@ -2186,7 +5465,11 @@ int wmain() {
 				scale = 4;
 				break;
 			case '0':
-				game.init({0,0,tileMapWidth,tileMapHeight});
+			{
+				std::unique_lock<std::shared_mutex> lock(worldMutex);
+				resetView();
+			}
+				pushCommand({sim_command::RESET, {0,0,tileMapWidth,tileMapHeight}, 0, (unsigned int)time(NULL)});
 				break;			
 			case 'u':
 				waterView = !waterView;
@@ -2208,15 +5491,28 @@ int wmain() {
 				plopsOnly = !plopsOnly;
 				break;
 			case 'k':
-				month++;
-				day = 1;
+				pushCommand({sim_command::SKIP_MONTH, {}, 0});
+				break;
+			case 'p':
+				dumpStats("stats.json");
+				break;
+			case '[':
+				simClock.setSpeed(simClock.speed / 2);
+				break;
+			case ']':
+				simClock.setSpeed(simClock.speed * 2);
 				break;
 			default:
 				graphicsUpdate = false;
 				break;
 		}
 		
-		display();
+		publishView();
+
+		{
+			std::shared_lock<std::shared_mutex> lock(worldMutex);
+			display(fresh);
+		}
 		
 		tp2 = std::chrono::system_clock::now();
 		std::chrono::duration<float> elapsedTime = tp2 - tp1;
@@ -2229,273 +5525,12 @@ int wmain() {
 			char buf[50];
 			int len = snprintf(&buf[0], 49, "%.1f fps - %.1f ms ft", (1.0f/elapsedTimef)*1000.0f, elapsedTimef);
 			adv::write(getScreenOffsetX(0.5, len), 0, &buf[0]);
+			screenDirty.mark({0, 0, adv::width, 1});
 		}
 		
 		adv::draw();
-		
-		//Issue random ticks
-		//1/10 chance for each
-		//100 tiles, issue 10 ticks
-		//200 tiles, issue 20 ticks
-		{
-			int ticksToIssue = tileMapWidth * tileMapHeight * 0.01f;
-			//ignore repeat for now
-			for (int i = 0; i < ticksToIssue; i++) {
-				int x = rand() % tileMapWidth;
-				int y = rand() % tileMapHeight;
-				tileComplete tc = getComplete(x, y);
-				tc.parent->onRandomEvent(tc);
-				
-				if (tc.partial->hasUnderground(UNDERGROUND_WATER_PIPE))
-					//((water_pipe*)(tiles::WATER_PIPE))->updateWater(tc);
-					water_pipe_tile.onUpdateEvent(tc);
-			}
-		}
-		
-		//game logic
-		if (microday++ > 30) {//once a second
-			microday = 0;
-			day++;
-			if (day > 31) {
-				month++;
-				day = 1;
-				fprintf(logFile, "Month %i\n", month);
-			}
-		}
-		
-		if (microday == 0)
-		switch (day) {
-			case 1: { //check for road connection
-				for (int x = 0; x < tileMapWidth; x++) {
-					for (int y = 0; y < tileMapHeight; y++) {
-						tileComplete tc = getComplete(x,y);
-						//if (tc.parent->needsRoadConnection(&tc))
-						//	tc.parent->updateRoadConnections(&tc);
-					}
-				}
-				break;
-			}
-			
-			case 2: { //concat capacity
-				commercialJobs = 0;
-				industrialJobs = 0;
-				residentialCapacity = 0;
-				commercialPopulation = 0;
-				industrialPopulation = 0;
-				population = 0;
-				
-				
-				for (int x = 0; x < tileMapWidth; x++) {
-					for (int y = 0; y < tileMapHeight; y++) {
-						tileComplete tc = getComplete(x,y);
-						/*
-						switch (tc.parent->getTileZone(&tc)) {
-							case ZONING_RESIDENTIAL: {
-								population += tc.parent->getPopulation(&tc);
-								residentialCapacity += tc.parent->getCapacity(&tc);
-								break;
-							}
-							case ZONING_COMMERCIAL: {
-								commercialPopulation += tc.parent->getPopulation(&tc);
-								commercialJobs += tc.parent->getCapacity(&tc);
-								break;
-							}
-							case ZONING_INDUSTRIAL: {
-								industrialPopulation += tc.parent->getPopulation(&tc);
-								industrialJobs += tc.parent->getPopulation(&tc);
-								break;
-							}
-						}
-						*/
-					}
-				}
-				
-				commercialDemand = (commercialPopulation + 1) / (commercialJobs + 1);
-				industrialDemand = (industrialPopulation + 1) / (industrialJobs + 1);
-				residentialDemand = (population + 1) / (residentialCapacity + 1);
-				break;
-			}
-			
-			case 3: {
-				network_summary sm =
-				balanceNetworks(WATER, isWaterNetwork);
-
-				waterSupply = sm.supply;
-				waterDemand = sm.demand;
-				waterNetworks = sm.networks;
-
-				break;
-			}
-
-			case -1: { //water calculations
-				waterNetworks = 0;
-				waterDemand = 0;
-				waterSupply = 0;
-
-				std::vector<tileBase*> frozen_instances = registry.instances;
-				//Network summary
-				//Not tile based yet
-				for (tileEventHandler *_teh : frozen_instances) {
-					if (_teh == nullptr)
-						continue;
-					tileBase *_ib = (tileBase*)_teh;
-					if (_ib == nullptr)
-						continue;
-					//fprintf(logFile, "Instance %i %p %p\n", _ib->id, _ib, registry.getInstance(_ib->id));
-					//fflush(logFile);
-					if (registry.getInstance(_ib->id)->getPlop() == nullptr)
-						continue;
-					plop *p = (plop*)_ib;
-
-					tileComplete tc = getComplete(p->size);
-					network_value* water = getNetwork(tc, WATER);
-					if (water == nullptr) {
-						//fprintf(logFile, "No water provider %i [%i %i] [%i %i]\n", p->id, tc.size.x, tc.size.y, p->size.x, p->size.y);
-						continue;
-					}
-
-					fprintf(logFile, "Water provider %i [%i %i] [%i %i] %f %f\n", p->id, tc.size.x, tc.size.y, p->size.x, p->size.y, water->getSupply(), water->getDemand());
-
-					waterSupply += water->getSupply();
-					waterDemand += water->getDemand();
-				}
-
-				//form water supply networks and distribute available water
-				std::vector<std::vector<tileComplete>> networks;
-				//for (auto _ip : plops.instances) {
-				for (int x = 0; x < tileMapWidth; x++) {
-					for (int y = 0; y < tileMapHeight; y++) {
-						tileEvent tile = getComplete(x, y);
-
-						if (!isWaterNetwork(tile))
-							continue; // Sources don't count without network connection
-
-						network_value *water = getNetwork(tile.with(0, SILENT), WATER);
-						if (water == nullptr || water->isDemand())
-							continue;
-
-						bool newNetwork = true;
-
-						for (auto network : networks) {
-							if (std::find(network.begin(), network.end(), tile) != network.end()) {
-								newNetwork = false;
-								break;
-							}
-						}
-
-						if (newNetwork) {
-							std::vector<tileComplete> network;
-							networks.push_back(walk_network(tile, isWaterNetwork, network));
-							waterNetworks++;
-						}
-					}
-				}
-
-				//reset water flags for correct display
-				for (int i = 0; i < tileMapWidth * tileMapHeight; i++) {
-					tileMap[i].setWater(false);
-				}
-
-				//send network signal
-				game.fireEvent({0,0,tileMapWidth,tileMapHeight}, NETWORK, WATER|TICK);
-
-				fprintf(logFile, "Water calculuation, current network count: %li, iter count: %i\n", networks.size(), waterNetworks);
-
-				//eh to test we'll set good networks with water
-				for (auto network : networks) {
-					std::vector<tileComplete> waterUsers;
-					std::vector<tileComplete> waterProviders;
-
-					//abs(tile.parent_plop_instance->waterUsage()) > 0.0f
-
-					float input = 0, output = 0;
-
-					for (tileEvent tile : network) { //find water providers
-						network_value* water = getNetwork(tile.with(0, SILENT), WATER);
-						if (water == nullptr)
-							continue;
-						if (std::find(waterProviders.begin(), waterProviders.end(), tile) != waterProviders.end())
-							continue; //if already accounted for, skip it
-						if (water->isSupply()) {
-							waterProviders.push_back(tile);
-							//input += tile.parent_plop_instance->waterUsage();
-							input += water->getSupply();
-						}
-					}
-					
-					if (waterProviders.empty())
-						continue; //no water providers, no state change for network
-
-					// best would be expanding radius from tiles in network based upon the available water remaining
-
-					//search radius for water users
-					for (auto tile : network) {
-						game.tileRadiusLoop(tile.size, 5, [&](posi p) {
-							tileEvent tc = getComplete(p);
-							network_value *water = getNetwork(tc.with(0, SILENT), WATER);
-							if (water == nullptr)
-								return;
-							if (std::find(waterUsers.begin(), waterUsers.end(), tile) != waterUsers.end())
-								return; //if already accounted for, skip it
-								
-							if (water->isDemand()) {
-								waterUsers.push_back(tile);
-								output += water->getDemand();
-							}
-						});
-					}
-
-					float ratio = input / output; //base the radius upon this
-
-					float maxRadius = 5.0f;
-					float radius = ratio * maxRadius;
-					if (radius < 0.0f)
-						radius = 0;
-					if (radius > maxRadius)
-						radius = maxRadius;
-
-					fprintf(logFile, "Network size %li\n", network.size());
-					fprintf(logFile, "input %f output %f ratio %f radius %f\n", input, output, ratio, radius);
-
-					//blindly set water based on radius
-					for (auto tile : network) {
-						tile.partial->setWater(true);
-						game.tileRadiusLoop(tile.size, radius, [&](posi p) {
-							tileComplete tc = getComplete(p);
-							if (tc.partial == nullptr)
-								return;
-
-							tc.partial->setWater(true);
-						});
-					}
-
-					for (auto user : waterUsers) {
-						network_value *water = getNetwork(user, WATER);
-						if (water == nullptr)
-							continue;
-						game.tileRadiusLoop(user.size, radius, [&](posi p) {
-							if (water->isSaturated() || water->isSupply()) {
-								fprintf(logFile, "Saturated or supply\n");
-								return;
-							}
-
-							tileComplete tc = getComplete(p);
-							if (!isWaterNetwork(tc))
-								return;
-							
-							fprintf(logFile, "Calc water\n");
-							input = water->give(input);
-						});
-
-						fprintf(logFile, "Water user %f/%f (%f)\n", water->getDemand(), water->getSupply(), input);
-					}
-
-				}
 
-
-				break;
-			}
-		}
+		std::this_thread::sleep_until(frameStart + frameInterval);
 	}	
 	
 	cleanupexit();
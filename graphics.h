@@ -23,6 +23,11 @@ struct _pos {
         x = p.x;
         y = p.y;
     }
+    _pos<T> &operator=(const _pos<T> &p) {
+        x = p.x;
+        y = p.y;
+        return *this;
+    }
     _pos(T x, T y) {
         this->x = x;
         this->y = y;
@@ -278,6 +283,49 @@ posf getOffsetXY(posf p) {
     return posf(getOffsetX(p), getOffsetY(p));
 }
 
+/*
+Inverse of getOffsetX and getOffsetY, the tile position under a screen offset
+*/
+posf getTileXY(float offsetX, float offsetY) {
+	float a = (offsetX - viewX) / xfact; //y * yfact + x * xfact
+	float b = (offsetY - viewY) / yfact; //y * yfact - x * xfact
+	return posf((a - b) / (2.0f * xfact), (a + b) / (2.0f * yfact));
+}
+
+/*
+Tile space box of a screen area given in offsets, padded by pad tiles
+x + y only moves the screen x and y - x only moves the screen y, so each screen axis
+bounds one of them and every column gets a single run of rows
+*/
+struct tile_range {
+	float umin, umax, vmin, vmax;
+
+	tile_range(float offsetX, float offsetY, float offsetWidth, float offsetHeight, float pad) {
+		posf start = getTileXY(offsetX, offsetY);
+		posf end = getTileXY(offsetX + offsetWidth, offsetY + offsetHeight);
+		umin = start.x + start.y - pad;
+		umax = end.x + end.y + pad;
+		vmin = start.y - start.x - pad;
+		vmax = end.y - end.x + pad;
+	}
+
+	int firstColumn() {
+		return floorf((umin - vmax) / 2.0f);
+	}
+
+	int lastColumn() {
+		return ceilf((umax - vmin) / 2.0f);
+	}
+
+	int firstRow(int x) {
+		return floorf(fmaxf(umin - x, vmin + x));
+	}
+
+	int lastRow(int x) {
+		return ceilf(fminf(umax - x, vmax + x));
+	}
+};
+
 float getCharacterYoverX() {
     return 2.0f;
 }
@@ -1,5 +1,7 @@
 #pragma once
 #include "graphics.h"
+#include <list>
+#include <unordered_map>
 
 struct dimension;
 struct draw_target;
@@ -16,6 +18,10 @@ struct sprite_overlay;
 struct random_overlay;
 struct simple_connecting_sprite;
 
+#define DIRTY_CELL_WIDTH 8
+#define DIRTY_CELL_HEIGHT 4
+#define RETAINED_BUDGET (8 << 20) //Bytes of sprite buffers kept before the least recently used go
+
 struct dimension {
 	virtual int getWidth() { return 0; }
 	virtual int getHeight() { return 0; }
@@ -40,6 +46,97 @@ struct draw_target : dimension {
 	}
 	virtual void draw(buffer_target *_in, posi XY);
 	virtual bool is_retained_mode() { return false; }
+
+	sizei clipBlit(buffer_target *_in, posi XY);
+
+	//One character wide line, clipped to the target
+	void line(posi a, posi b, cpix pix) {
+		sizei limit = getSize();
+		int dx = abs(b.x - a.x), dy = -abs(b.y - a.y);
+		int sx = a.x < b.x ? 1 : -1, sy = a.y < b.y ? 1 : -1;
+		int err = dx + dy;
+		while (true) {
+			if (limit.contains(a))
+				draw(a, pix);
+			if (a.x == b.x && a.y == b.y)
+				break;
+			int e2 = err * 2;
+			if (e2 >= dy) {
+				err += dy;
+				a.x += sx;
+			}
+			if (e2 <= dx) {
+				err += dx;
+				a.y += sy;
+			}
+		}
+	}
+};
+
+/*
+Screen cells that need drawing again, one flag per DIRTY_CELL_WIDTH by DIRTY_CELL_HEIGHT block
+*/
+struct dirty_region {
+	int width = 0, height = 0;
+	std::vector<unsigned char> cells;
+	bool any = false;
+
+	void resize(posi screen) {
+		width = (screen.x + DIRTY_CELL_WIDTH - 1) / DIRTY_CELL_WIDTH;
+		height = (screen.y + DIRTY_CELL_HEIGHT - 1) / DIRTY_CELL_HEIGHT;
+		cells.assign(width * height, 0);
+		markAll();
+	}
+
+	void markAll() {
+		std::fill(cells.begin(), cells.end(), 1);
+		any = true;
+	}
+
+	void mark(sizei area) {
+		int x0 = std::max(area.x / DIRTY_CELL_WIDTH, 0);
+		int y0 = std::max(area.y / DIRTY_CELL_HEIGHT, 0);
+		int x1 = std::min((area.x + area.width - 1) / DIRTY_CELL_WIDTH, width - 1);
+		int y1 = std::min((area.y + area.height - 1) / DIRTY_CELL_HEIGHT, height - 1);
+		for (int y = y0; y <= y1; y++)
+			for (int x = x0; x <= x1; x++)
+				cells[y * width + x] = any = 1;
+	}
+
+	void reset() {
+		std::fill(cells.begin(), cells.end(), 0);
+		any = false;
+	}
+
+	bool cell(int x, int y) {
+		return cells[y * width + x];
+	}
+
+	//Outside points count as the nearest cell
+	bool test(posi p) {
+		int x = std::min(std::max(p.x, 0) / DIRTY_CELL_WIDTH, width - 1);
+		int y = std::min(std::max(p.y, 0) / DIRTY_CELL_HEIGHT, height - 1);
+		return width && height && cells[y * width + x];
+	}
+
+	//Every cell within padX, padY cells of a dirty one
+	void grow(dirty_region &out, int padX, int padY) {
+		out.width = width;
+		out.height = height;
+		out.any = any;
+		std::vector<unsigned char> rows(cells.size(), 0);
+		out.cells.assign(cells.size(), 0);
+		for (int y = 0; y < height; y++)
+			for (int x = 0; x < width; x++)
+				if (cells[y * width + x])
+					for (int i = std::max(x - padX, 0); i <= std::min(x + padX, width - 1); i++)
+						rows[y * width + i] = 1;
+		for (int y = 0; y < height; y++)
+			for (int x = 0; x < width; x++)
+				if (rows[y * width + x])
+					for (int j = std::max(y - padY, 0); j <= std::min(y + padY, height - 1); j++)
+						out.cells[j * width + x] = 1;
+	}
 };
 
 struct adv_target : draw_target {
@@ -48,6 +145,8 @@ struct adv_target : draw_target {
 	void draw(posi p, cpix pix) override {
 		adv::write(p.x, p.y, pix.ch, pix.co);
 	}
+	using draw_target::draw;
+	void draw(buffer_target *_in, posi XY) override;
 };
 
 struct buffer_target : draw_target {
@@ -68,6 +167,15 @@ struct buffer_target : draw_target {
 		}
 	}
 
+	void clear(dirty_region &region) {
+		for (int cy = 0; cy < region.height; cy++)
+			for (int cx = 0; cx < region.width; cx++)
+				if (region.cell(cx, cy))
+					for (int y = cy * DIRTY_CELL_HEIGHT; y < std::min((cy + 1) * DIRTY_CELL_HEIGHT, size.height); y++)
+						for (int x = cx * DIRTY_CELL_WIDTH; x < std::min((cx + 1) * DIRTY_CELL_WIDTH, size.width); x++)
+							buffer[y * size.width + x] = null_cpix();
+	}
+
 	void free() {
 		if (buffer)
 			delete[] buffer;
@@ -96,8 +204,13 @@ struct buffer_target : draw_target {
 
 	using draw_target::draw;
 	void draw(posi p, cpix pix) override {
+		if (clip && !clip->test(p))
+			return;
 		*get(p) = pix;
 	}
+	void draw(buffer_target *_in, posi XY) override;
+
+	dirty_region *clip = nullptr; //When set, only dirty cells are drawn
 
 	bool shouldUpdate() {
 		return stale;
@@ -108,23 +221,67 @@ struct buffer_target : draw_target {
 	virtual bool is_retained_mode() { return true; }
 };
 
-void draw_target::draw(buffer_target *_in, posi XY) {
+/*
+Part of _in that lands on this target when drawn at XY, in _in coordinates
+*/
+sizei draw_target::clipBlit(buffer_target *_in, posi XY) {
 	sizei os = this->getSize();
 	sizei is = _in->getSize();
-	for (int x = 0; x < is.width; x++) {
-		for (int y = 0; y < is.height; y++) {
-			posi ob = XY.add(x,y);
-			posi ib = posi(x,y);
-			if (os.contains(ob)) {
-				cpix pix = *_in->get(ib);
-				if (pix.ch != 0)
-					draw(ob, pix);
+	int x0 = std::max(0, os.x - XY.x);
+	int y0 = std::max(0, os.y - XY.y);
+	int x1 = std::min(is.width, os.x + os.width - XY.x);
+	int y1 = std::min(is.height, os.y + os.height - XY.y);
+	return {x0, y0, std::max(x1 - x0, 0), std::max(y1 - y0, 0)};
+}
+
+//Row by row over the clipped area, cells with no character are see through
+void draw_target::draw(buffer_target *_in, posi XY) {
+	sizei src = clipBlit(_in, XY);
+	for (int y = src.y; y < src.y + src.height; y++) {
+		cpix *in = _in->get({0, y});
+		for (int x = src.x; x < src.x + src.width; x++)
+			if (in[x].ch != 0)
+				draw(XY.add(x, y), in[x]);
+	}
+}
+
+void adv_target::draw(buffer_target *_in, posi XY) {
+	sizei src = clipBlit(_in, XY);
+	for (int y = src.y; y < src.y + src.height; y++) {
+		cpix *in = _in->get({0, y});
+		for (int x = src.x; x < src.x + src.width; x++)
+			if (in[x].ch != 0)
+				adv::write(XY.x + x, XY.y + y, in[x].ch, in[x].co);
+	}
+}
+
+/*
+Copies rows straight into the buffer, a dirty clip is tested once per cell it covers
+The select keeps what is under empty cells and leaves the loop free of branches
+*/
+void buffer_target::draw(buffer_target *_in, posi XY) {
+	sizei src = clipBlit(_in, XY);
+	for (int y = src.y; y < src.y + src.height; y++) {
+		cpix *in = _in->get({0, y});
+		int row = (XY.y + y) * size.width + XY.x;
+		int x = src.x, end = src.x + src.width;
+		while (x < end) {
+			int stop = end;
+			if (clip) {
+				int ox = XY.x + x;
+				stop = std::min(end, x + DIRTY_CELL_WIDTH - ox % DIRTY_CELL_WIDTH);
+				if (!clip->test({ox, XY.y + y})) {
+					x = stop;
+					continue;
+				}
 			}
+			for (; x < stop; x++)
+				buffer[row + x] = in[x].ch != 0 ? in[x] : buffer[row + x];
 		}
 	}
 }
 
-struct retained_target : buffer_target {
+struct retained_target final : buffer_target {
 	retained_target(sizei XYWH, image *img=nullptr, int state=0) : buffer_target(XYWH) {
 		this->reference_image = img;
 		this->state = state;
@@ -138,15 +295,94 @@ struct retained_target : buffer_target {
 
 	image *reference_image; 
 	int state;
-	bool persistent;
-	bool render;
+	bool persistent = false;
+	bool render = false;
 
 	bool shouldDelete() {
 		return !persistent && !render;
 	}
+
+	size_t bytes() {
+		return size.area() * sizeof(cpix);
+	}
 };
 
-std::vector<retained_target*> retained_targets;
+/*
+Retained sprites by image, state and size
+Lookups are hashed, the least recently used are freed when the buffers pass the budget
+*/
+struct retained_cache {
+	struct key {
+		image *img;
+		int state;
+		sizei size;
+
+		bool operator==(const key &b) const {
+			return img == b.img && state == b.state && size == b.size;
+		}
+	};
+
+	struct key_hash {
+		size_t operator()(const key &k) const {
+			uint64_t h = (uint64_t)(uintptr_t)k.img;
+			h = h * 31 + k.state;
+			h = h * 31 + (uint32_t)k.size.x;
+			h = h * 31 + (uint32_t)k.size.y;
+			h = h * 31 + (uint32_t)k.size.width;
+			h = h * 31 + (uint32_t)k.size.height;
+			return std::hash<uint64_t>()(h * 0x9e3779b97f4a7c15ull);
+		}
+	};
+
+	std::list<std::pair<key, retained_target*>> order; //Most recent first
+	std::unordered_map<key, std::list<std::pair<key, retained_target*>>::iterator, key_hash> index;
+	size_t budget = RETAINED_BUDGET;
+	size_t bytes = 0;
+	unsigned long hits = 0, misses = 0, evictions = 0;
+
+	retained_target *get(image *img, sizei XYWH, int state) {
+		key k = {img, state, XYWH};
+		auto it = index.find(k);
+		if (it != index.end()) {
+			hits++;
+			order.splice(order.begin(), order, it->second);
+			return it->second->second;
+		}
+
+		misses++;
+		retained_target *rt = new retained_target(XYWH, img, state);
+		order.emplace_front(k, rt);
+		index[k] = order.begin();
+		bytes += rt->bytes();
+		evict();
+		return rt;
+	}
+
+	//Free from the back until under the budget, the newest entry always stays
+	void evict() {
+		if (order.empty())
+			return;
+		auto it = std::prev(order.end());
+		while (bytes > budget && it != order.begin()) {
+			auto newer = std::prev(it);
+			retained_target *rt = it->second;
+			bytes -= rt->bytes();
+			index.erase(it->first);
+			order.erase(it);
+			delete rt;
+			evictions++;
+			it = newer;
+		}
+	}
+
+	size_t size() {
+		return index.size();
+	}
+} retained_targets;
+
+retained_target *make_or_get_retained_target(image *img, sizei XYWH, int state=0) {
+	return retained_targets.get(img, XYWH, state);
+}
 
 /*
 From 0-1 of a sample
@@ -154,6 +390,11 @@ From 0-1 of a sample
 struct sample_source {
 	virtual pixel sampleImage(float x, float y) { return pixel(0, 0, 0); }
 	virtual cpix sampleComposed(float x, float y) { return empty_cpix(); }
+
+	//The composed image samples read from and the texel a coordinate lands on, nullptr when there is none
+	virtual pixel_image *composedImage() { return nullptr; }
+	virtual int composedColumn(float) { return 0; }
+	virtual int composedRow(float) { return 0; }
 };
 
 /*
@@ -214,6 +455,20 @@ struct pixel_image : image {
 		return composedData[imY * dim.x + imX];
 	}
 
+	pixel_image *composedImage() override {
+		return composedData ? this : nullptr;
+	}
+
+	int composedColumn(float x) override {
+		int imX = x * getDim().x;
+		return imX;
+	}
+
+	int composedRow(float y) override {
+		int imY = y * getDim().y;
+		return imY;
+	}
+
 	pixel sampleImage(float x, float y) override {
 		posi dim = getDim();
 
@@ -308,6 +563,22 @@ struct pixel_image : image {
 
 		compose();
 	}
+
+	//Blend every texel amount of the way to color, alpha is kept
+	void tint(pixel color, float amount) {
+		if (!textureData)
+			return;
+
+		posi dim = getDim();
+		int target[3] = { color.r, color.g, color.b };
+		for (int i = 0; i < dim.x * dim.y; i++)
+			for (int c = 0; c < 3; c++) {
+				ubyte &v = textureData[i * bpp + c];
+				v = v + (target[c] - v) * amount;
+			}
+
+		compose();
+	}
 };
 
 struct atlas_fragment;
@@ -348,6 +619,18 @@ struct atlas_fragment : image {
 		posf atl = mapToAtlas(posf(x, y));
 		return sourceAtlas->sampleComposed(atl.x, atl.y);
 	}
+
+	pixel_image *composedImage() override {
+		return sourceAtlas->composedImage();
+	}
+
+	int composedColumn(float x) override {
+		return sourceAtlas->composedColumn(mapToAtlas(posf(x, 0)).x);
+	}
+
+	int composedRow(float y) override {
+		return sourceAtlas->composedRow(mapToAtlas(posf(0, y)).y);
+	}
 };
 
 atlas_fragment atlas::fragment(sizei sprite_units) {
@@ -379,7 +662,52 @@ struct sprite : atlas_fragment {
 		setAtlas(sizei(x, y, w, h));
 	}
 
-	virtual void setAtlas(sizei area) {	atlasSpriteArea = area; }
+	virtual void setAtlas(sizei area) {	atlasSpriteArea = area; scaled.width = -1; }
+
+	/*
+	Source texel of every output column and row at one scale, both ways round for flips
+	Built from the same float math as sampling so the integer path picks the same texels
+	*/
+	struct scale_table {
+		int width = -1, height = -1;
+		cpix *source = nullptr;
+		int stride = 0;
+		std::vector<int> columns[2], rows[2]; //[flipped]
+		bool opaque = false; //Every texel the tables reach passes the alpha test
+	} scaled;
+
+	static float scaleCoordinate(int i, int length, bool flip) {
+		float f = float(i) / length;
+		if (flip)
+			f = .99999 - f;
+		return f;
+	}
+
+	scale_table &scaleTable(int width, int height, pixel_image *src) {
+		if (scaled.width == width && scaled.height == height && scaled.source == src->composedData)
+			return scaled;
+
+		scaled.width = width;
+		scaled.height = height;
+		scaled.source = src->composedData;
+		scaled.stride = src->getWidth();
+		for (int f = 0; f < 2; f++) {
+			scaled.columns[f].resize(width);
+			scaled.rows[f].resize(height);
+			for (int x = 0; x < width; x++)
+				scaled.columns[f][x] = composedColumn(scaleCoordinate(x, width, f));
+			for (int y = 0; y < height; y++)
+				scaled.rows[f][y] = composedRow(scaleCoordinate(y, height, f)) * scaled.stride;
+		}
+
+		scaled.opaque = true;
+		for (int fy = 0; fy < 2 && scaled.opaque; fy++)
+			for (int y = 0; y < height && scaled.opaque; y++)
+				for (int fx = 0; fx < 2 && scaled.opaque; fx++)
+					for (int x = 0; x < width && scaled.opaque; x++)
+						scaled.opaque = scaled.source[scaled.rows[fy][y] + scaled.columns[fx][x]].a == 255;
+		return scaled;
+	}
 
 	/*
 	Send start screen coordinates, screen width and height per sprite unit
@@ -399,6 +727,32 @@ struct sprite : atlas_fragment {
 			screen.height * atlas.height
 		};
 
+		if (area.width <= 0 || area.height <= 0)
+			return;
+
+		//Nearest neighbour through the index tables, integer lookups only
+		if (pixel_image *src = composedImage()) {
+			scale_table &table = scaleTable(area.width, area.height, src);
+			int *columns = &table.columns[hflip][0];
+			int *rows = &table.rows[!vflip][0];
+			for (int y = 0; y < area.height; y++) {
+				cpix *row = table.source + rows[y];
+				for (int x = 0; x < area.width; x++) {
+					posi scr = area.start().add(x,-y);
+
+					if (!scrLimit.contains(scr))
+						continue;
+
+					cpix chco = row[columns[x]];
+					if (!table.opaque && chco.a < 255)
+						continue;
+
+					target->draw(scr, chco);
+				}
+			}
+			return;
+		}
+
 		for (int x = 0; x < area.width; x++) {
 			for (int y = 0; y < area.height; y++) {
 				posi scr = area.start().add(x,-y);
@@ -426,6 +780,42 @@ struct sprite : atlas_fragment {
 	void draw(sizei area, draw_target *target, bool hflip = false, bool vflip = false) {
 		draw(area, atlasSpriteArea, target, hflip, vflip);
 	}
+
+	/*
+	Draw through a retained buffer when the target keeps them
+	paint fills the buffer once per state and scale, the same way it would draw to the target
+	*/
+	template<typename F>
+	void draw_retained(sizei screen, draw_target *target, int state, F paint) {
+		if (!target->is_retained_mode()) {
+			paint(screen, target);
+			return;
+		}
+
+		sizei atlas = atlasSpriteArea;
+		posi length = {screen.width * atlas.width, screen.height * atlas.height};
+		posi offset = {0, length.y - 1};
+		buffer_target *acceptor = (buffer_target*)target;
+		retained_target *retained = make_or_get_retained_target(this, {{0,0}, length}, state);
+
+		if (retained->shouldUpdate()) {
+			retained->clear();
+			paint(offset.with(screen.length()), retained);
+			retained->stale = false;
+			acceptor->stale = true;
+		}
+
+		retained->render = true;
+
+		if (acceptor->shouldUpdate())
+			acceptor->draw(retained, screen.start().sub(offset));
+	}
+
+	void draw_retained(sizei area, draw_target *target, bool hflip = false, bool vflip = false) {
+		draw_retained(area, target, hflip << 1 | vflip, [&](sizei s, draw_target *t) {
+			draw(s, t, hflip, vflip);
+		});
+	}
 };
 
 struct sprite_overlay : sprite {
@@ -443,6 +833,18 @@ struct sprite_overlay : sprite {
 		return canvas.sampleImage(x, y);
 	}
 
+	pixel_image *composedImage() override {
+		return canvas.composedImage();
+	}
+
+	int composedColumn(float x) override {
+		return canvas.composedColumn(x);
+	}
+
+	int composedRow(float y) override {
+		return canvas.composedRow(y);
+	}
+
 	void set(sprite *sp) {
 		canvas.blank(getDim());
 		add(sp);
@@ -453,6 +855,22 @@ struct sprite_overlay : sprite {
 	}
 };
 
+/*
+Base sprite blended toward a colour, load once the atlas is loaded
+*/
+struct tinted_sprite : sprite_overlay {
+	tinted_sprite(sprite *base, pixel color, float amount):sprite_overlay(base), base(base), color(color), amount(amount) {}
+
+	sprite *base;
+	pixel color;
+	float amount;
+
+	void load() {
+		set(base);
+		canvas.tint(color, amount);
+	}
+};
+
 struct random_overlay : sprite_overlay {
 	random_overlay(sprite *base, sprite *overlay):sprite_overlay(base) {
 		//if (rand() % 5 == 0)
@@ -491,21 +909,16 @@ struct simple_connecting_sprite : sprite {
 		draw_connections(area, target, con[0], con[1], con[2], con[3]);
 	}
 
-	sprite *base, *over;
-};
-
-retained_target *make_or_get_retained_target(image *img, sizei XYWH, int state=0) {
-	for (retained_target *rt : retained_targets) {
-		if (rt->reference_image == img && 
-			rt->state == state && 
-			rt->size == XYWH)
-				return rt;
+	//Each connection mask is its own retained variant
+	void draw_connections_retained(sizei area, draw_target *target, bool *con) {
+		int state = con[0] | con[1] << 1 | con[2] << 2 | con[3] << 3;
+		draw_retained(area, target, state, [&](sizei s, draw_target *t) {
+			draw_connections(s, t, con);
+		});
 	}
 
-	retained_target *rt = new retained_target(XYWH, img, state);
-	retained_targets.push_back(rt);
-	return rt;
-}
+	sprite *base, *over;
+};
 
 sprite selector_sprite(1,2,1,1);
 
@@ -527,6 +940,10 @@ sprite wet_dirt_sprite(3,0,1,1);
 sprite dry_plop_sprite(1,4,1,1);
 sprite wet_plop_sprite(1,3,1,1);
 
+tinted_sprite residential_zone_sprite(&dry_dirt_sprite, pixel(60, 200, 60), 0.5f);
+tinted_sprite commercial_zone_sprite(&dry_dirt_sprite, pixel(60, 100, 230), 0.5f);
+tinted_sprite industrial_zone_sprite(&dry_dirt_sprite, pixel(230, 200, 40), 0.5f);
+
 sprite water_tower_sprite(0,1,1,2);
 sprite water_well_sprite(0,4,1,1);
 sprite large_water_pump_sprite(0,7,2,2);